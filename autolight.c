@@ -4,18 +4,37 @@
 #include <getopt.h>
 #include <time.h>
 #include <limits.h>
+#include <unistd.h>
+#include <errno.h>
 #include <linux/videodev2.h>
-#include <math.h>
 #include "lib/v4l2.h"
+#include "lib/luma.h"
+#include "lib/mjpeg.h"
+#include "lib/scene.h"
+#include "lib/governor.h"
+#include "lib/estimate.h"
 #include "lib/xws.h"
+#include "lib/ddc.h"
+#include "lib/cache.h"
+#include "lib/tslog.h"
+#include "lib/hotplug.h"
+#include "lib/background.h"
 
 #define CLOCK_TO_MS(clock) (((clock) * 1000) / CLOCKS_PER_SEC)
 
-#define STD_RGB_TO_BRIGHTNESS(R,G,B) (0.2126*(R) + 0.7152*(G) + 0.0722*(B))
-#define OPT1_RGB_TO_BRIGHTNESS(R,G,B) (0.299*(R) + 0.587*(G) + 0.114*(B))
-#define OPT2_RGB_TO_BRIGHTNESS(R,G,B) (sqrt(0.299*pow((R), 2) + 0.587*pow((G), 2) + 0.114*pow((B), 2)))
+#define STD_RGB_COEFFICIENTS {0.2126, 0.7152, 0.0722}
+#define OPT1_RGB_COEFFICIENTS {0.299, 0.587, 0.114}
+#define OPT2_RGB_COEFFICIENTS {0.299, 0.587, 0.114}
 
 #define DEFAULT_CALIBRATE_FRAMES 24
+// Exposure seeded from the last run converges within a few frames.
+#define RESTORED_CALIBRATE_FRAMES 4
+// Brightness and camera controls are saved at most this often.
+#define STATE_SAVE_INTERVAL_MS 60000
+// Missing camera is probed at least this often, uevents may be unavailable or come before access is granted.
+#define CAMERA_RETRY_MS 2000
+// DDC/CI monitors are scanned again once docking events have been quiet this long.
+#define DDC_RESCAN_DELAY_MS 1000
 #define DEFAULT_INTERACTIVE_TIMEOUT 1000
 
 enum OPTIONS {
@@ -27,17 +46,28 @@ enum OPTIONS {
 	CALIBRATE_TIMES_OPTION,
 	BRIGHTNESS_OPTION,
 	INTERACTIVE_OPTION,
+	LINEAR_OPTION,
+	THREADS_OPTION,
+	CHANGE_TOLERANCE_OPTION,
+	STATS_OPTION,
+	CPU_BUDGET_OPTION,
+	ESTIMATE_OPTION,
+	DDC_OPTION,
+	LOG_OPTION,
+	BACKGROUND_OPTION,
 	UNRECOGNIZED_OPTION
 };
 
 enum BRIGHTNESS_ALGORITHM_OPTIONS {
 	BRIGHTNESS_ALGORITHM_STD,
 	BRIGHTNESS_ALGORITHM_OPT1,
-	BRIGHTNESS_ALGORITHM_OPT2
+	BRIGHTNESS_ALGORITHM_OPT2,
+	BRIGHTNESS_ALGORITHM_CUSTOM
 };
 
 extern int capture_width;
 extern int capture_height;
+extern int capture_auto;
 
 /**
 h - help
@@ -46,10 +76,12 @@ c - calibrate
 	Calibrate frames
 x - brightness algorithm
 i - interactive
+j - decoding threads
+s - statistics
  */
-static char* short_options = "hd:c:x:i::";
+static char* short_options = "hd:c:x:i::j:s";
 // The sequence of this array must match enum OPTIONS.
-static struct option long_options[9] = {
+static struct option long_options[18] = {
 	{
 		"help",
 		no_argument,
@@ -90,28 +122,109 @@ static struct option long_options[9] = {
 		optional_argument,
 		NULL, 0
 	},
+	{
+		"linear",
+		no_argument,
+		NULL, 0
+	},
+	{
+		"threads",
+		required_argument,
+		NULL, 0
+	},
+	{
+		"change-tolerance",
+		required_argument,
+		NULL, 0
+	},
+	{
+		"stats",
+		no_argument,
+		NULL, 0
+	},
+	{
+		"cpu-budget",
+		required_argument,
+		NULL, 0
+	},
+	{
+		"estimate",
+		required_argument,
+		NULL, 0
+	},
+	{
+		"ddc",
+		optional_argument,
+		NULL, 0
+	},
+	{
+		"log",
+		required_argument,
+		NULL, 0
+	},
+	{
+		"background",
+		optional_argument,
+		NULL, 0
+	},
 	{0}
 };
 
-static char* help_msg = "Autolight. Cameras driver must support MJPEG video streaming type and memory MMAP.\n\
+static char* help_msg = "Autolight. Cameras driver must support MJPEG or YUYV video streaming type and memory MMAP.\n\
 -h (--help) This message.\n\
 -d (--device=DEVICE_FILE) Video camera device file. \"/dev/video(0-9)\" by default.\n\
---display=DISPLAY_NAME Display name. By default used $DISPLAY from envs.\n\
---width=VALUE Camera capture width(640px default).\n\
---height=VALUE Camera capture height(480px default).\n\
+--display=DISPLAY_NAME[,DISPLAY_NAME...] Display names. By default used $DISPLAY from envs.\n\
+\tBacklight of all outputs of all displays is set, unusable displays and outputs are skipped.\n\
+--width=VALUE Camera capture width(640px default) in MJPEG.\n\
+--height=VALUE Camera capture height(480px default) in MJPEG.\n\
+\tWithout width and height the cheapest mode (MJPEG or YUYV, size, frame interval) camera enumerates is used, \
+it is cached per device.\n\
 -c (--calibrate=VALUE) Frames used to calibrate camera exposure. Only if camera supports V4L2_EXPOSURE_AUTO, \
 V4L2_EXPOSURE_SHUTTER_PRIORITY or V4L2_EXPOSURE_APERTURE_PRIORITY auto type. Ignored otherwise.\n\
--x (--brightness=[STD|OPT1|OPT2]) Algorithm to calculate delta brightness.\n\
+-x (--brightness=[STD|OPT1|OPT2|R,G,B]) Algorithm to calculate delta brightness.\n\
 \tSTD: 0.2126 * R + 0.7152 * G + 0.0722 * B\n\
 \tOPT1: 0.299 * R + 0.587 * G + 0.114 * B\n\
-\tOPT2: sqrt(0.299 * R^2 + 0.587 * G^2 + 0.114 * B^2\n";
-
-static char display_name[32] = {0};
+\tOPT2: sqrt(0.299 * R^2 + 0.587 * G^2 + 0.114 * B^2\n\
+\tR,G,B: custom channel coefficients, e.g. 0.25,0.5,0.25\n\
+--linear Convert sRGB values to linear light before applying the algorithm.\n\
+-j (--threads=VALUE) Threads decoding frames with restart intervals. Online CPUs count by default, \
+CPUs autolight may run on with --background.\n\
+--change-tolerance=PERCENT Reuse the previous brightness while frame signature differs less (1 by default, 0 disables).\n\
+-s (--stats) Print statistics after every sample.\n\
+--cpu-budget=PERCENT CPU usage limit in percents of one core (interactive mode). Decode scale, capture size \
+and sampling interval are traded to stay within it. Off by default.\n\
+--estimate=PERCENT Stop metering a frame once its mean brightness is known within +-PERCENT (95% confidence). \
+Off by default.\n\
+--ddc[=I2C_DEVICE_FILE[,I2C_DEVICE_FILE...]] Also set brightness of external monitors over DDC/CI. \
+By default I2C adapters of display connectors answering DDC/CI are used.\n\
+--log=FILE Record samples and stage timings to a memory mapped ring log, read it with autolight-logread.\n\
+--background[=pin] Low impact mode: SCHED_BATCH sampling and decoding, SCHED_IDLE DDC/CI writer, 50ms timer slack and \
+sampling wakeups aligned to whole seconds (the interval is rounded up to whole seconds). \
+pin also pins threads to efficiency cores.\n";
+
+static char* display_names = NULL;
+static int ddc = 0;
+static char* ddc_paths = NULL;
+static char* log_path = NULL;
+static int background = 0;
+static int background_pin = 0;
 static char* device_name = NULL;
 static int calibrate_frames = DEFAULT_CALIBRATE_FRAMES;
 static int interactive_timeout = DEFAULT_INTERACTIVE_TIMEOUT;
 static int brightness_algo = BRIGHTNESS_ALGORITHM_STD;
+static double brightness_coefficients[3] = STD_RGB_COEFFICIENTS;
+static int linear_light = 0;
+static int decode_threads = 0;
+static double change_tolerance = SCENE_DEFAULT_TOLERANCE;
+static int stats = 0;
+static double cpu_budget = 0;
+static double estimate_tolerance_percents = 0;
+// Negotiated capture size the governor divides.
+static int base_width, base_height;
+static int size_divisor = 1;
 static int auto_exposure = 0;
+// Exposure of the open camera has been restored, it needs only a short calibration.
+static int controls_restored = 0;
 static int interactive = 0;
 
 static int set_options(enum OPTIONS option) {
@@ -134,16 +247,23 @@ static int set_options(enum OPTIONS option) {
 		}
 		case DISPLAY_OPTION: {
 			if (optarg != 0) {
-				strcpy(display_name, optarg);
+				display_names = malloc(strlen(optarg) + 1);
+				if (NULL == display_names) {
+					fprintf(stderr, "Out of memory\n");
+					exit(EXIT_FAILURE);
+				}
+				strcpy(display_names, optarg);
 			}
 			break;
 		}
 		case WIDTH_OPTION: {
 			capture_width = atoi(optarg);
+			capture_auto = 0;
 			break;
 		}
 		case HEIGHT_OPTION: {
 			capture_height = atoi(optarg);
+			capture_auto = 0;
 			break;
 		}
 		case CALIBRATE_TIMES_OPTION: {
@@ -151,10 +271,33 @@ static int set_options(enum OPTIONS option) {
 			break;
 		}
 		case BRIGHTNESS_OPTION: {
-			if (strcmp(optarg, "opt1") == 0 || strcmp(optarg, "OPT1") == 0) {
+			if (strcmp(optarg, "std") == 0 || strcmp(optarg, "STD") == 0) {
+				double coefficients[3] = STD_RGB_COEFFICIENTS;
+
+				brightness_algo = BRIGHTNESS_ALGORITHM_STD;
+				memcpy(brightness_coefficients, coefficients, sizeof(coefficients));
+			} else if (strcmp(optarg, "opt1") == 0 || strcmp(optarg, "OPT1") == 0) {
+				double coefficients[3] = OPT1_RGB_COEFFICIENTS;
+
 				brightness_algo = BRIGHTNESS_ALGORITHM_OPT1;
+				memcpy(brightness_coefficients, coefficients, sizeof(coefficients));
 			} else if (strcmp(optarg, "opt2") == 0 || strcmp(optarg, "OPT2") == 0) {
+				double coefficients[3] = OPT2_RGB_COEFFICIENTS;
+
 				brightness_algo = BRIGHTNESS_ALGORITHM_OPT2;
+				memcpy(brightness_coefficients, coefficients, sizeof(coefficients));
+			} else {
+				double coefficients[3];
+				char tail;
+
+				// All three coefficients or nothing, a partial parse must not mix with the previous ones.
+				if (sscanf(optarg, "%lf,%lf,%lf%c", &coefficients[0], &coefficients[1], &coefficients[2], &tail) != 3) {
+					fprintf(stderr, "Invalid brightness '%s', expected STD, OPT1, OPT2 or R,G,B coefficients\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				brightness_algo = BRIGHTNESS_ALGORITHM_CUSTOM;
+				memcpy(brightness_coefficients, coefficients, sizeof(coefficients));
 			}
 			break;
 		}
@@ -165,6 +308,61 @@ static int set_options(enum OPTIONS option) {
 			}
 			break;
 		}
+		case LINEAR_OPTION: {
+			linear_light = 1;
+			break;
+		}
+		case THREADS_OPTION: {
+			decode_threads = atoi(optarg);
+			break;
+		}
+		case CHANGE_TOLERANCE_OPTION: {
+			change_tolerance = atof(optarg);
+			break;
+		}
+		case STATS_OPTION: {
+			stats = 1;
+			break;
+		}
+		case CPU_BUDGET_OPTION: {
+			cpu_budget = atof(optarg);
+			break;
+		}
+		case ESTIMATE_OPTION: {
+			estimate_tolerance_percents = atof(optarg);
+			break;
+		}
+		case DDC_OPTION: {
+			ddc = 1;
+			if (NULL != optarg) {
+				ddc_paths = malloc(strlen(optarg) + 1);
+				if (NULL == ddc_paths) {
+					fprintf(stderr, "Out of memory\n");
+					exit(EXIT_FAILURE);
+				}
+				strcpy(ddc_paths, optarg);
+			}
+			break;
+		}
+		case BACKGROUND_OPTION: {
+			background = 1;
+			if (NULL != optarg) {
+				if (strcmp(optarg, "pin") != 0) {
+					return -1;
+				}
+				background_pin = 1;
+			}
+			break;
+		}
+		case LOG_OPTION: {
+			log_path = malloc(strlen(optarg) + 1);
+			if (NULL == log_path) {
+				fprintf(stderr, "Out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+			strcpy(log_path, optarg);
+			break;
+		}
 		case UNRECOGNIZED_OPTION: {
 			return -1;
 		}
@@ -177,59 +375,51 @@ static int set_options(enum OPTIONS option) {
 }
 
 // Returns value in range from 0 to 1.
-static double image_brightness() {
-	unsigned char* frame;
-	unsigned char* pframe;
-	unsigned char R, G, B;
-	unsigned int frame_pixels = capture_height * capture_width;
-	unsigned int frame_bytes = frame_pixels * 3;
-	double delta_brightness = 0.0;
-
-	frame = malloc(frame_bytes);
+// brightness receives value in range from 0 to 1. Returns -1 if the camera is lost.
+static int image_brightness(double* brightness) {
+	unsigned long long frame_pixels;
+	unsigned long long delta_brightness;
 
-	if (NULL == frame) {
-		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+	if (-1 == read_frame_luma(&delta_brightness, &frame_pixels)) {
+		return -1;
 	}
 
-	pframe = frame;
-	read_frame(frame);
+	*brightness = luma_mean(delta_brightness, frame_pixels);
 
-	switch (brightness_algo) {
-		case BRIGHTNESS_ALGORITHM_STD: {
-			for (int i = 0; i < frame_pixels; i++) {
-				R = *pframe++;
-				G = *pframe++;
-				B = *pframe++;
-				delta_brightness += STD_RGB_TO_BRIGHTNESS(R, G, B);
-			}
-			break;
-		}
-		case BRIGHTNESS_ALGORITHM_OPT1: {
-			for (int i = 0; i < frame_pixels; i++) {
-				R = *pframe++;
-				G = *pframe++;
-				B = *pframe++;
-				delta_brightness += OPT1_RGB_TO_BRIGHTNESS(R, G, B);
-			}
-			break;
-		}
-		case BRIGHTNESS_ALGORITHM_OPT2: {
-			for (int i = 0; i < frame_pixels; i++) {
-				R = *pframe++;
-				G = *pframe++;
-				B = *pframe++;
-				delta_brightness += OPT2_RGB_TO_BRIGHTNESS(R, G, B);
-			}
-			break;
-		}
+	return 0;
+}
+
+static void print_stats(long brightness) {
+	unsigned long frames, reused;
+
+	scene_stats(&frames, &reused);
+
+	fprintf(stderr, "brightness=%ld frames=%lu reused=%lu hit_rate=%.1f%% cpu=%.3f%% point=%d capture=%dx%d scale=1/%d interval=%dms touched=%.1f%% wakeups=%.1f/s\n",
+		brightness, frames, reused, frames ? reused * 100.0 / frames : 0.0, governor_usage() * 100, governor_level(),
+		capture_width, capture_height, governor_point()->scale_denom,
+		interactive_timeout * governor_point()->interval_multiplier, estimate_touched() * 100, background_wakeups());
+}
+
+static void apply_operating_point() {
+	const struct operating_point* point = governor_point();
+
+	mjpeg_set_scale(point->scale_denom);
+
+	if (point->size_divisor != size_divisor) {
+		size_divisor = point->size_divisor;
+		set_capture_size(base_width / size_divisor, base_height / size_divisor);
 	}
+}
 
-	free(frame);
-	return (delta_brightness / (capture_width * capture_height))/UCHAR_MAX;
+static void sleep_ms(long ms) {
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+
+	while (-1 == nanosleep(&ts, &ts) && EINTR == errno);
 }
 
 static void calibrate_cam() {
+	int frames = controls_restored && calibrate_frames > RESTORED_CALIBRATE_FRAMES ?
+		RESTORED_CALIBRATE_FRAMES : calibrate_frames;
 	unsigned char* frame;
 #	ifdef DEBUG
 	clock_t frame_start, frame_end, frame_avg;
@@ -238,7 +428,7 @@ static void calibrate_cam() {
 	calibrate_start = clock();
 #	endif
 
-	if (!calibrate_frames) {
+	if (!frames) {
 		return;
 	}
 
@@ -249,11 +439,14 @@ static void calibrate_cam() {
 		exit(EXIT_FAILURE);
 	}
 
-	for (int i = 0; i < calibrate_frames; i++) {
+	for (int i = 0; i < frames; i++) {
 #		ifdef DEBUG
 		frame_start = clock();
 #		endif
-		read_frame(frame);
+		if (-1 == read_frame(frame)) {
+			// Lost camera is handled by the main loop.
+			break;
+		}
 #		ifdef DEBUG
 		frame_end = clock();
 		frame_avg += frame_end - frame_start;
@@ -262,7 +455,7 @@ static void calibrate_cam() {
 #	ifdef DEBUG
 	calibrate_end = clock();
 
-	frame_avg /= calibrate_frames;
+	frame_avg /= frames;
 	printf("Frame average time: %ldms\n", (long)CLOCK_TO_MS(frame_avg));
 	printf("Calibrate time: %ldms\n", (long)CLOCK_TO_MS(calibrate_end - calibrate_start));
 #	endif
@@ -270,32 +463,183 @@ static void calibrate_cam() {
 	free(frame);
 }
 
+static void open_camera() {
+	open_device(device_name);
+	auto_exposure = init_device();
+	controls_restored = auto_exposure && restore_controls();
+
+#	ifdef DEBUG
+	printf("Auto exposure: %s\n", auto_exposure ? "on" : "off");
+	printf("Capture width(recognized): %dpx\n", capture_width);
+	printf("Capture height(recognized): %dpx\n", capture_height);
+#	endif
+
+	base_width = capture_width;
+	base_height = capture_height;
+	size_divisor = 1;
+
+	init_mmap();
+	start_capturing();
+}
+
+/**
+ * Reacts to hotplug: DDC/CI monitors are scanned again when docking changes, X outputs when RandR reports it.
+ * Docking comes as a burst of events, so the scan waits until events calm down. It runs on the DDC/CI
+ * writer thread and doesn't block sampling.
+ */
+static void handle_hotplug(int events) {
+	static int rescan = 0;
+	static struct timespec rescan_at;
+	struct timespec now;
+
+	if (ddc && NULL == ddc_paths) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (events & (HOTPLUG_I2C | HOTPLUG_DRM)) {
+			rescan = 1;
+			rescan_at = now;
+		}
+
+		if (rescan && (now.tv_sec - rescan_at.tv_sec) * 1000 +
+			(now.tv_nsec - rescan_at.tv_nsec) / 1000000 >= DDC_RESCAN_DELAY_MS) {
+			rescan = 0;
+			ddc_rescan();
+		}
+	}
+
+	xws_poll_events();
+}
+
+static void wait_camera() {
+	fprintf(stderr, "Waiting for camera\n");
+
+	while (!device_available(device_name)) {
+		handle_hotplug(hotplug_wait(CAMERA_RETRY_MS));
+	}
+}
+
+// Releases lost camera and resumes sampling with it or the default one once it is back.
+static void reopen_camera() {
+	close_device();
+	wait_camera();
+	open_camera();
+
+	apply_operating_point();
+	if (auto_exposure) {
+		calibrate_cam();
+	}
+}
+
+// Saves brightness and camera controls after the first sample, then only changes and not too often.
+static void save_state(long brightness) {
+	static int saved = 0;
+	static struct timespec saved_at;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (saved && (brightness == cache_get_long("brightness", -1) ||
+		(now.tv_sec - saved_at.tv_sec) * 1000 + (now.tv_nsec - saved_at.tv_nsec) / 1000000 < STATE_SAVE_INTERVAL_MS)) {
+		return;
+	}
+
+	saved = 1;
+	saved_at = now;
+	cache_set_long("brightness", brightness);
+	save_controls();
+}
+
+static long elapsed_us(const struct timespec* start, const struct timespec* end) {
+	return (end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
 static void main_loop() {
 	long brightness;
+	double measured;
+	int xws_result, ddc_result, point_changed;
+	unsigned long frames, reused, last_reused = 0;
+	struct timespec sample_start, frame_end, backlight_end, sample_end, now;
+	struct tslog_record record;
 
 	if (auto_exposure) {
 		calibrate_cam();
 	}
 
+	governor_start();
+	// Starts measuring wakeups.
+	background_wakeups();
+
 	do {
-		brightness = (long)(image_brightness() * 100);
+		if (interactive) {
+			handle_hotplug(hotplug_poll());
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &sample_start);
+		if (-1 == image_brightness(&measured)) {
+			if (!interactive) {
+				exit(EXIT_FAILURE);
+			}
+			reopen_camera();
+			continue;
+		}
+		brightness = (long)(measured * 100);
+		clock_gettime(CLOCK_MONOTONIC, &frame_end);
 
 #		ifdef DEBUG
 		printf("Calculated brightness: %lu (100 max)\n", brightness);
 #		endif
-		if (xws_backlight_set(brightness) == -1) {
-			fprintf(stderr, "Can't find any valid output(xcb)");
+		// DDC/CI writes are queued, so X outputs aren't delayed.
+		xws_result = xws_backlight_set(brightness);
+		ddc_result = ddc_backlight_set(brightness);
+		if (xws_result == -1 && ddc_result == -1) {
+			fprintf(stderr, "Can't find any valid output\n");
+		}
+		clock_gettime(CLOCK_MONOTONIC, &backlight_end);
+
+		save_state(brightness);
+
+		if (stats) {
+			print_stats(brightness);
+		}
+
+		point_changed = interactive && governor_update();
+		if (point_changed) {
+			apply_operating_point();
+		}
+
+		if (tslog_enabled()) {
+			clock_gettime(CLOCK_MONOTONIC, &sample_end);
+			clock_gettime(CLOCK_REALTIME, &now);
+			scene_stats(&frames, &reused);
+
+			memset(&record, 0, sizeof(record));
+			record.timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+			record.frame_us = elapsed_us(&sample_start, &frame_end);
+			record.backlight_us = elapsed_us(&frame_end, &backlight_end);
+			record.sample_us = elapsed_us(&sample_start, &sample_end);
+			record.brightness = measured * TSLOG_BRIGHTNESS_SCALE;
+			record.backlight = xws_result == -1 && ddc_result == -1 ? -1 : brightness;
+			record.point = governor_level();
+			record.flags = (reused != last_reused ? TSLOG_FLAG_REUSED : 0) | (point_changed ? TSLOG_FLAG_POINT_CHANGED : 0);
+			last_reused = reused;
+
+			tslog_write(&record);
 		}
 
 		if (interactive && interactive_timeout) {
-			// TODO: interactive timer
-			// sleep(interactive_timeout);
+			if (background) {
+				background_sleep((long)interactive_timeout * governor_point()->interval_multiplier);
+			} else {
+				sleep_ms((long)interactive_timeout * governor_point()->interval_multiplier);
+			}
 		}
 	} while (interactive);
 }
 
 int main(int argc, char* argv[]) {
 	int option;
+	int xws_result, ddc_result;
+	long last_brightness;
 	enum OPTIONS long_option;
 	int long_option_ind;
 
@@ -327,6 +671,14 @@ int main(int argc, char* argv[]) {
 					long_option = INTERACTIVE_OPTION;
 					break;
 				}
+				case 'j': {
+					long_option = THREADS_OPTION;
+					break;
+				}
+				case 's': {
+					long_option = STATS_OPTION;
+					break;
+				}
 				case '?': {
 					long_option = UNRECOGNIZED_OPTION;
 					break;
@@ -344,37 +696,78 @@ int main(int argc, char* argv[]) {
 	}
 
 #	ifdef DEBUG
-	if (*display_name == 0) {
+	if (NULL == display_names) {
 		printf("Default display (%s)\n", getenv("DISPLAY"));
 	} else {
-		printf("Display name: %s\n", display_name);
+		printf("Display names: %s\n", display_names);
 	}
 	printf("Capture width(requested): %dpx\n", capture_width);
 	printf("Capture height(requested): %dpx\n", capture_height);
 	printf("Calibrate exposure frames: %d\n", calibrate_frames);
-	printf("Brightness algorithm: %s\n", brightness_algo == BRIGHTNESS_ALGORITHM_STD ? "STD_RGB_TO_BRIGHTNESS" :
-			brightness_algo == BRIGHTNESS_ALGORITHM_OPT1 ? "OPT1_RGB_TO_BRIGHTNESS" : "OPT2_RGB_TO_BRIGHTNESS");
+	printf("Brightness algorithm: %s (%g, %g, %g)%s\n", brightness_algo == BRIGHTNESS_ALGORITHM_STD ? "STD" :
+			brightness_algo == BRIGHTNESS_ALGORITHM_OPT1 ? "OPT1" : brightness_algo == BRIGHTNESS_ALGORITHM_OPT2 ? "OPT2" : "CUSTOM",
+			brightness_coefficients[0], brightness_coefficients[1], brightness_coefficients[2], linear_light ? " linear" : "");
 	if (interactive) {
 		printf("Interactive mode with frequency: %dms\n", interactive_timeout);
 	}
 #	endif
 
-    open_device(device_name);
-	auto_exposure = init_device();
+	if (NULL != log_path) {
+		tslog_open(log_path, TSLOG_DEFAULT_RECORDS);
+	}
 
-#	ifdef DEBUG
-	printf("Auto exposure: %s\n", auto_exposure ? "on" : "off");
-	printf("Capture width(recognized): %dpx\n", capture_width);
-	printf("Capture height(recognized): %dpx\n", capture_height);
-#	endif
+	luma_init(brightness_coefficients[0], brightness_coefficients[1], brightness_coefficients[2],
+		brightness_algo == BRIGHTNESS_ALGORITHM_OPT2, linear_light);
+
+	// Before any thread starts, threads inherit scheduling.
+	if (background) {
+		background_init(background_pin);
+	}
+
+	// Pinned background threads can't use other cpus.
+	if (decode_threads <= 0) {
+		decode_threads = background ? background_cpus() : sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	mjpeg_init(decode_threads);
+	scene_init(change_tolerance);
+	estimate_init(estimate_tolerance_percents);
+
+	xws_result = xws_init(display_names);
+	ddc_result = ddc ? ddc_init(ddc_paths) : -1;
+	if (xws_result == -1 && ddc_result == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (interactive) {
+		hotplug_init();
+		if (!device_available(device_name)) {
+			wait_camera();
+		}
+	}
+
+	open_camera();
+	governor_init(cpu_budget, interactive_timeout);
+
+	// The last brightness is the best guess until the camera is calibrated.
+	last_brightness = cache_get_long("brightness", -1);
+	if (last_brightness != -1) {
+		xws_backlight_set(last_brightness);
+		ddc_backlight_set(last_brightness);
+	}
 
-	init_mmap();
-	xws_init(display_name);
-	start_capturing();
 	main_loop();
 	close_device();
+	mjpeg_close();
+	scene_close();
+	xws_close();
+	ddc_close();
+	tslog_close();
+	hotplug_close();
 
 	free(device_name);
+	free(display_names);
+	free(ddc_paths);
+	free(log_path);
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,453 @@
+// Decoding and metering microbenchmarks on synthetic MJPEG frames.
+// Prints one JSON object per line.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <jpeglib.h>
+#include "../lib/luma.h"
+#include "../lib/mjpeg.h"
+#include "../lib/estimate.h"
+#include "../lib/background.h"
+
+#define DEFAULT_MIN_TIME_MS 200
+#define MIN_ITERATIONS 3
+// Confidence interval half width of the early terminating benchmark, percents.
+#define ESTIMATE_PERCENTS 0.5
+// Interactive sampling loop of the default interval, measured without and with --background.
+#define SAMPLING_INTERVAL_MS 1000
+#define SAMPLING_WIDTH 640
+#define SAMPLING_HEIGHT 480
+#define SAMPLING_QUALITY 75
+// Dark frame lit by a bright band only, sparse sampling easily misses it.
+#define LOCALIZED_WIDTH 640
+#define LOCALIZED_HEIGHT 480
+#define LOCALIZED_LEVEL 30
+#define LOCALIZED_TOP 40
+#define LOCALIZED_BOTTOM 88
+// Early terminated estimate of the localized frame may be off by this many tolerances at most.
+#define LOCALIZED_MAX_ERROR 2
+
+static unsigned long allocations = 0;
+
+#ifdef __GLIBC__
+// glibc entry points behind the interposed allocator, other C libraries report no allocations.
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+extern void __libc_free(void*);
+
+void* malloc(size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+	__libc_free(ptr);
+}
+#endif
+
+struct resolution {
+	int width;
+	int height;
+};
+
+struct algorithm {
+	char* name;
+	double r, g, b;
+	int squared;
+	int linear;
+};
+
+static struct resolution resolutions[] = {{320, 240}, {640, 480}, {1280, 720}, {1920, 1080}};
+static int qualities[] = {50, 75, 95};
+static struct algorithm algorithms[] = {
+	{"STD", 0.2126, 0.7152, 0.0722, 0, 0},
+	{"OPT1", 0.299, 0.587, 0.114, 0, 0},
+	{"OPT2", 0.299, 0.587, 0.114, 1, 0},
+	{"STD_LINEAR", 0.2126, 0.7152, 0.0722, 0, 1}
+};
+
+static long min_time_ms = DEFAULT_MIN_TIME_MS;
+static int threads = 0;
+
+static double now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Room-like picture: lit gradient, a few flat objects and sensor noise.
+static void synthesize(unsigned char* frame, int width, int height, unsigned int seed) {
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			unsigned char* pixel = frame + (y * width + x) * 3;
+			int base = 40 + 140 * x / width + 40 * y / height;
+
+			if ((x / (width / 5) + y / (height / 4)) % 3 == 0) {
+				base -= 30;
+			}
+
+			for (int c = 0; c < 3; c++) {
+				int value;
+
+				seed = seed * 1103515245 + 12345;
+				value = base + c * 10 - 10 + (int)((seed >> 16) % 9) - 4;
+				pixel[c] = value < 0 ? 0 : value > 255 ? 255 : value;
+			}
+		}
+	}
+}
+
+static unsigned char* compress(const unsigned char* frame, int width, int height, int quality, int restart,
+	unsigned long* length) {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned char* data = NULL;
+	unsigned char* row[1];
+
+	*length = 0;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &data, length);
+
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, 1);
+	// Cameras emitting restart markers usually do it every MCU row.
+	cinfo.restart_in_rows = restart;
+
+	jpeg_start_compress(&cinfo, 1);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		row[0] = (unsigned char*)frame + cinfo.next_scanline * width * 3;
+		jpeg_write_scanlines(&cinfo, row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	return data;
+}
+
+// BT.601 limited range YUYV of RGB pixels, chroma of a pair is averaged.
+static void to_yuyv(const unsigned char* rgb, unsigned char* yuyv, unsigned int pixels) {
+	for (unsigned int i = 0; i + 1 < pixels; i += 2, rgb += 6, yuyv += 4) {
+		int r = (rgb[0] + rgb[3]) / 2, g = (rgb[1] + rgb[4]) / 2, b = (rgb[2] + rgb[5]) / 2;
+
+		yuyv[0] = 16 + ((66 * rgb[0] + 129 * rgb[1] + 25 * rgb[2] + 128) >> 8);
+		yuyv[1] = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+		yuyv[2] = 16 + ((66 * rgb[3] + 129 * rgb[4] + 25 * rgb[5] + 128) >> 8);
+		yuyv[3] = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+	}
+}
+
+/**
+ * error - largest deviation of the measured mean brightness from the exact one in percents
+ * of full scale, negative if the measurement isn't compared.
+ */
+static void report(char* name, char* algorithm, int width, int height, int quality, int restart,
+	unsigned long length, long frames, double elapsed, unsigned long allocated, double error) {
+	printf("{\"bench\":\"%s\",\"algorithm\":\"%s\",\"width\":%d,\"height\":%d,\"quality\":%d,"
+		"\"restart\":%d,\"threads\":%d,\"bytes\":%lu,\"frames\":%ld,\"ns_per_pixel\":%.3f,"
+		"\"fps\":%.1f,\"allocs_per_frame\":%.2f",
+		name, algorithm, width, height, quality, restart, threads, length, frames,
+		elapsed / frames / ((double)width * height), frames * 1e9 / elapsed, (double)allocated / frames);
+	if (error >= 0) {
+		printf(",\"error_percent\":%.3f", error);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+// Runs body until MIN_ITERATIONS and min_time_ms are both reached.
+#define MEASURE(frames, elapsed, allocated, body) do { \
+	double start_ = now_ns(); \
+	unsigned long allocations_ = allocations; \
+	frames = 0; \
+	do { \
+		body; \
+		frames++; \
+		elapsed = now_ns() - start_; \
+	} while (frames < MIN_ITERATIONS || elapsed < min_time_ms * 1e6); \
+	allocated = allocations - allocations_; \
+} while (0)
+
+// Meters frame by one thread, as frames without restart intervals always are.
+static unsigned long long serial_luma(const unsigned char* data, unsigned long length, unsigned long long* pixels) {
+	unsigned long long sum;
+
+	if (threads == 1) {
+		return mjpeg_luma(data, length, pixels);
+	}
+
+	mjpeg_close();
+	mjpeg_init(1);
+	sum = mjpeg_luma(data, length, pixels);
+	mjpeg_close();
+	mjpeg_init(threads);
+
+	return sum;
+}
+
+static void bench_resolution(int width, int height) {
+	unsigned char* frame = malloc(width * height * 3);
+	unsigned char* decoded = malloc(width * height * 3);
+	unsigned char* yuyv = malloc(width * height * 2);
+	volatile unsigned long long sink = 0;
+	double exact, error;
+	unsigned long allocated;
+	double elapsed;
+	long frames;
+
+	if (NULL == frame || NULL == decoded || NULL == yuyv) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	synthesize(frame, width, height, width * height);
+
+	for (int a = 0; a < sizeof(algorithms) / sizeof(*algorithms); a++) {
+		struct algorithm* algorithm = &algorithms[a];
+
+		luma_init(algorithm->r, algorithm->g, algorithm->b, algorithm->squared, algorithm->linear);
+		MEASURE(frames, elapsed, allocated, sink += luma_sum(frame, width * height));
+		report("brightness", algorithm->name, width, height, 0, 0, 0, frames, elapsed, allocated, -1);
+	}
+
+	luma_init(algorithms[0].r, algorithms[0].g, algorithms[0].b, 0, 0);
+
+	// YUYV is metered from luma only, compared with the exact brightness of the source frame.
+	to_yuyv(frame, yuyv, width * height);
+	exact = luma_mean(luma_sum(frame, width * height), width * height);
+	error = fabs(luma_mean(luma_yuyv_sum(yuyv, width * height), width * height) - exact) * 100;
+	MEASURE(frames, elapsed, allocated, sink += luma_yuyv_sum(yuyv, width * height));
+	report("yuyv_brightness", algorithms[0].name, width, height, 0, 0, width * height * 2, frames, elapsed, allocated,
+		error);
+
+	for (int q = 0; q < sizeof(qualities) / sizeof(*qualities); q++) {
+		for (int restart = 0; restart <= 1; restart++) {
+			unsigned long length;
+			unsigned long long pixels, sum, exact_sum;
+			unsigned int signature[MJPEG_SIGNATURE_CELLS];
+			unsigned char* data = compress(frame, width, height, qualities[q], restart, &length);
+
+			MEASURE(frames, elapsed, allocated, mjpeg_decode(data, length, decoded));
+			report("decode", "", width, height, qualities[q], restart, length, frames, elapsed, allocated, -1);
+
+			// Parallel metering at restart markers must match the serial one exactly.
+			exact_sum = serial_luma(data, length, &pixels);
+			sum = mjpeg_luma(data, length, &pixels);
+			if (sum != exact_sum || pixels != (unsigned long long)width * height) {
+				fprintf(stderr, "%dx%d quality %d restart %d: metered sum %llu of %llu pixels, serial decode %llu\n",
+					width, height, qualities[q], restart, sum, pixels, exact_sum);
+				exit(EXIT_FAILURE);
+			}
+			exact = luma_mean(exact_sum, pixels);
+
+			MEASURE(frames, elapsed, allocated, sink += mjpeg_luma(data, length, &pixels));
+			report("decode_brightness", algorithms[0].name, width, height, qualities[q], restart, length,
+				frames, elapsed, allocated, 0);
+
+			estimate_init(ESTIMATE_PERCENTS);
+			error = 0;
+			MEASURE(frames, elapsed, allocated, {
+				double deviation;
+
+				sum = mjpeg_luma(data, length, &pixels);
+				deviation = fabs(luma_mean(sum, pixels) - exact) * 100;
+				error = deviation > error ? deviation : error;
+			});
+			estimate_init(0);
+			report("decode_estimate", algorithms[0].name, width, height, qualities[q], restart, length,
+				frames, elapsed, allocated, error);
+
+			MEASURE(frames, elapsed, allocated, mjpeg_signature(data, length, signature));
+			report("signature", "", width, height, qualities[q], restart, length, frames, elapsed, allocated, -1);
+
+			free(data);
+		}
+	}
+
+	free(yuyv);
+	free(decoded);
+	free(frame);
+}
+
+/**
+ * Compares early terminated metering of a dark frame with a bright band to full metering,
+ * exits with an error if the estimate is off by more than LOCALIZED_MAX_ERROR tolerances.
+ */
+static void bench_localized(void) {
+	unsigned char* frame = malloc(LOCALIZED_WIDTH * LOCALIZED_HEIGHT * 3);
+	unsigned long long pixels, sum;
+	unsigned long allocated;
+	double elapsed, exact, error;
+	long frames;
+
+	if (NULL == frame) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int y = 0; y < LOCALIZED_HEIGHT; y++) {
+		memset(frame + y * LOCALIZED_WIDTH * 3, y >= LOCALIZED_TOP && y < LOCALIZED_BOTTOM ? 255 : LOCALIZED_LEVEL,
+			LOCALIZED_WIDTH * 3);
+	}
+
+	for (int restart = 0; restart <= 1; restart++) {
+		unsigned long length;
+		unsigned char* data = compress(frame, LOCALIZED_WIDTH, LOCALIZED_HEIGHT, SAMPLING_QUALITY, restart, &length);
+
+		sum = mjpeg_luma(data, length, &pixels);
+		exact = luma_mean(sum, pixels);
+
+		estimate_init(ESTIMATE_PERCENTS);
+		// Sampling stride of frames without restart intervals follows the scene a frame late, let it settle.
+		for (int i = 0; i < ESTIMATE_MAX_STRIDE; i++) {
+			mjpeg_luma(data, length, &pixels);
+		}
+		error = 0;
+		MEASURE(frames, elapsed, allocated, {
+			double deviation;
+
+			sum = mjpeg_luma(data, length, &pixels);
+			deviation = fabs(luma_mean(sum, pixels) - exact) * 100;
+			error = deviation > error ? deviation : error;
+		});
+		estimate_init(0);
+		report("localized_estimate", algorithms[0].name, LOCALIZED_WIDTH, LOCALIZED_HEIGHT, SAMPLING_QUALITY, restart,
+			length, frames, elapsed, allocated, error);
+
+		if (error > LOCALIZED_MAX_ERROR * ESTIMATE_PERCENTS) {
+			fprintf(stderr, "Localized frame restart %d: estimate off by %.3f%%, full mean %.4f\n",
+				restart, error, exact);
+			exit(EXIT_FAILURE);
+		}
+
+		free(data);
+	}
+
+	free(frame);
+}
+
+static void sleep_ms(long ms) {
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+
+	while (-1 == nanosleep(&ts, &ts) && EINTR == errno);
+}
+
+static double cpu_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Meters a frame every SAMPLING_INTERVAL_MS like `autolight -i` does and reports context switches
+ * (wakeups) per second and CPU time per sample. Background mode can't be left, so it goes last.
+ */
+static void bench_sampling(void) {
+	unsigned char* frame = malloc(SAMPLING_WIDTH * SAMPLING_HEIGHT * 3);
+	volatile unsigned long long sink = 0;
+	unsigned long long pixels;
+	unsigned long length;
+	unsigned char* data;
+	long samples = min_time_ms / SAMPLING_INTERVAL_MS > MIN_ITERATIONS ? min_time_ms / SAMPLING_INTERVAL_MS : MIN_ITERATIONS;
+
+	if (NULL == frame) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	synthesize(frame, SAMPLING_WIDTH, SAMPLING_HEIGHT, SAMPLING_WIDTH * SAMPLING_HEIGHT);
+	data = compress(frame, SAMPLING_WIDTH, SAMPLING_HEIGHT, SAMPLING_QUALITY, 1, &length);
+
+	for (int background = 0; background <= 1; background++) {
+		double cpu_start, wakeups;
+
+		if (background) {
+			mjpeg_close();
+			background_init(0);
+			mjpeg_init(threads);
+		}
+
+		background_wakeups();
+		cpu_start = cpu_ns();
+
+		for (long s = 0; s < samples; s++) {
+			sink += mjpeg_luma(data, length, &pixels);
+			if (background) {
+				background_sleep(SAMPLING_INTERVAL_MS);
+			} else {
+				sleep_ms(SAMPLING_INTERVAL_MS);
+			}
+		}
+
+		wakeups = background_wakeups();
+		printf("{\"bench\":\"sampling\",\"mode\":\"%s\",\"width\":%d,\"height\":%d,\"threads\":%d,"
+			"\"samples\":%ld,\"wakeups_per_s\":%.2f,\"cpu_us_per_sample\":%.1f}\n",
+			background ? "background" : "default", SAMPLING_WIDTH, SAMPLING_HEIGHT, threads, samples, wakeups,
+			(cpu_ns() - cpu_start) / samples / 1000);
+		fflush(stdout);
+	}
+
+	free(data);
+	free(frame);
+}
+
+int main(int argc, char* argv[]) {
+	int option;
+
+	while ((option = getopt(argc, argv, "j:t:")) != -1) {
+		switch (option) {
+			case 'j': {
+				threads = atoi(optarg);
+				break;
+			}
+			case 't': {
+				min_time_ms = atol(optarg);
+				break;
+			}
+			default: {
+				fprintf(stderr, "Usage: %s [-j threads] [-t min_time_ms]\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	mjpeg_init(threads);
+
+	for (int r = 0; r < sizeof(resolutions) / sizeof(*resolutions); r++) {
+		bench_resolution(resolutions[r].width, resolutions[r].height);
+	}
+
+	bench_localized();
+	bench_sampling();
+
+	mjpeg_close();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include "background.h"
+
+static int enabled = 0;
+
+// Parses cpu list like "0-3,8,10-11" into set, returns count of cpus.
+static int parse_cpus(const char* list, cpu_set_t* set) {
+	const char* p = list;
+
+	CPU_ZERO(set);
+
+	while (*p >= '0' && *p <= '9') {
+		char* end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+
+		if (*end == '-') {
+			last = strtol(end + 1, &end, 10);
+		}
+
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, set);
+		}
+
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	return CPU_COUNT(set);
+}
+
+/**
+ * Finds efficiency cores: Intel hybrid atom cores or the least capable cores of ARM big.LITTLE.
+ * Returns count of found cpus, 0 if cores don't differ.
+ */
+static int efficiency_cpus(cpu_set_t* set) {
+	char line[256], path[BACKGROUND_PATH_MAXLEN];
+	long capacities[CPU_SETSIZE];
+	long min = -1, max = -1;
+	int cpus;
+	FILE* file;
+
+	file = fopen(BACKGROUND_ATOM_CPUS, "r");
+	if (NULL != file) {
+		int count = NULL != fgets(line, sizeof(line), file) ? parse_cpus(line, set) : 0;
+
+		fclose(file);
+		if (count) {
+			return count;
+		}
+	}
+
+	for (cpus = 0; cpus < CPU_SETSIZE; cpus++) {
+		snprintf(path, sizeof(path), BACKGROUND_CPU_CAPACITY, cpus);
+
+		file = fopen(path, "r");
+		if (NULL == file) {
+			break;
+		}
+
+		if (1 != fscanf(file, "%ld", &capacities[cpus])) {
+			capacities[cpus] = -1;
+		}
+		fclose(file);
+
+		if (capacities[cpus] != -1 && (min == -1 || capacities[cpus] < min)) {
+			min = capacities[cpus];
+		}
+		if (capacities[cpus] > max) {
+			max = capacities[cpus];
+		}
+	}
+
+	CPU_ZERO(set);
+
+	if (min == max) {
+		return 0;
+	}
+
+	for (int cpu = 0; cpu < cpus; cpu++) {
+		if (capacities[cpu] == min) {
+			CPU_SET(cpu, set);
+		}
+	}
+
+	return CPU_COUNT(set);
+}
+
+/**
+ * Moves the process to SCHED_BATCH: it still gets its share under load, but doesn't preempt
+ * interactive tasks when it wakes up. Timers get generous slack and, if pin is set, threads run
+ * on efficiency cores. Must be called before any thread starts, so decoding workers inherit it:
+ * the sampling thread waits for them, as SCHED_IDLE they would stall it under any load.
+ */
+void background_init(int pin) {
+	struct sched_param param = {0};
+	cpu_set_t set;
+
+	enabled = 1;
+
+	if (-1 == sched_setscheduler(0, SCHED_BATCH, &param)) {
+		fprintf(stderr, "SCHED_BATCH error %d, %s\n", errno, strerror(errno));
+	}
+
+	if (-1 == prctl(PR_SET_TIMERSLACK, BACKGROUND_TIMER_SLACK_NS, 0, 0, 0)) {
+		fprintf(stderr, "PR_SET_TIMERSLACK error %d, %s\n", errno, strerror(errno));
+	}
+
+	if (pin) {
+		if (!efficiency_cpus(&set)) {
+			fprintf(stderr, "No efficiency cores found, not pinned\n");
+		} else if (-1 == sched_setaffinity(0, sizeof(set), &set)) {
+			fprintf(stderr, "sched_setaffinity error %d, %s\n", errno, strerror(errno));
+		}
+	}
+
+#	ifdef DEBUG
+	printf("Background mode, %d cpus\n", background_cpus());
+#	endif
+}
+
+/**
+ * Moves the calling helper thread to SCHED_IDLE, it runs only when cpus are otherwise idle.
+ * Only for threads nobody waits for (the DDC/CI writer). Does nothing outside background mode.
+ */
+void background_idle(void) {
+	struct sched_param param = {0};
+
+	if (enabled && -1 == sched_setscheduler(0, SCHED_IDLE, &param)) {
+		fprintf(stderr, "SCHED_IDLE error %d, %s\n", errno, strerror(errno));
+	}
+}
+
+/**
+ * Sleeps until the next multiple of period_ms, rounded up to BACKGROUND_ALIGN_MS, of the monotonic
+ * clock. Wakeups of all timers aligned the same way coincide, so cpus stay in deep idle states longer.
+ */
+void background_sleep(long period_ms) {
+	long long period_ns, now_ns, wake_ns;
+	struct timespec now, wake;
+
+	period_ms = (period_ms + BACKGROUND_ALIGN_MS - 1) / BACKGROUND_ALIGN_MS * BACKGROUND_ALIGN_MS;
+	period_ns = period_ms * 1000000LL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+	wake_ns = (now_ns / period_ns + 1) * period_ns;
+
+	wake.tv_sec = wake_ns / 1000000000;
+	wake.tv_nsec = wake_ns % 1000000000;
+
+	while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL));
+}
+
+// Returns count of cpus the process may run on.
+int background_cpus(void) {
+	cpu_set_t set;
+
+	if (-1 == sched_getaffinity(0, sizeof(set), &set)) {
+		return 1;
+	}
+
+	return CPU_COUNT(&set);
+}
+
+// Returns context switches of all threads per second since the previous call, the first call returns 0.
+double background_wakeups(void) {
+	static long last_switches = -1;
+	static struct timespec last;
+	struct rusage usage;
+	struct timespec now;
+	long switches;
+	double seconds, rate = 0;
+
+	getrusage(RUSAGE_SELF, &usage);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	switches = usage.ru_nvcsw + usage.ru_nivcsw;
+
+	if (last_switches != -1) {
+		seconds = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+		rate = seconds > 0 ? (switches - last_switches) / seconds : 0;
+	}
+
+	last_switches = switches;
+	last = now;
+
+	return rate;
+}
@@ -0,0 +1,22 @@
+// Low impact scheduling of a long running helper.
+
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+// Timers may fire this late, so the kernel can serve them together with others.
+#define BACKGROUND_TIMER_SLACK_NS 50000000
+// Sampling wakeups are aligned to multiples of this period of the monotonic clock.
+#define BACKGROUND_ALIGN_MS 1000
+// Efficiency cores of Intel hybrid CPUs.
+#define BACKGROUND_ATOM_CPUS "/sys/devices/cpu_atom/cpus"
+// Relative performance of ARM big.LITTLE cores.
+#define BACKGROUND_CPU_CAPACITY "/sys/devices/system/cpu/cpu%d/cpu_capacity"
+#define BACKGROUND_PATH_MAXLEN 64
+
+void background_init(int);
+void background_idle(void);
+void background_sleep(long);
+int background_cpus(void);
+double background_wakeups(void);
+
+#endif
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+struct entry {
+	char key[CACHE_KEY_MAXLEN];
+	char value[CACHE_VALUE_MAXLEN];
+};
+
+struct store {
+	struct entry entries[CACHE_MAX_ENTRIES];
+	int entries_count;
+	char path[CACHE_PATH_MAXLEN];
+};
+
+// Store of the device in use, cache_get() and cache_set() work on it.
+static struct store active;
+
+// $XDG_CACHE_HOME/autolight or ~/.cache/autolight, created with parents if missing.
+static int cache_dir(char* dir, size_t size) {
+	char* base = getenv("XDG_CACHE_HOME");
+	int len;
+
+	if (NULL != base && *base) {
+		len = snprintf(dir, size, "%s/%s", base, CACHE_DIR);
+	} else if (NULL != (base = getenv("HOME")) && *base) {
+		len = snprintf(dir, size, "%s/.cache/%s", base, CACHE_DIR);
+	} else {
+		return -1;
+	}
+
+	if (len < 0 || len >= size) {
+		return -1;
+	}
+
+	for (char* slash = strchr(dir + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+		if (NULL != slash) {
+			*slash = 0;
+		}
+		if (-1 == mkdir(dir, 0755) && EEXIST != errno) {
+			return -1;
+		}
+		if (NULL == slash) {
+			break;
+		}
+		*slash = '/';
+	}
+
+	return 0;
+}
+
+static struct entry* store_find(struct store* store, const char* key) {
+	for (int i = 0; i < store->entries_count; i++) {
+		if (strcmp(store->entries[i].key, key) == 0) {
+			return &store->entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void store_set(struct store* store, const char* key, const char* value) {
+	struct entry* entry = store_find(store, key);
+
+	if (NULL == entry) {
+		if (store->entries_count == CACHE_MAX_ENTRIES) {
+			return;
+		}
+		entry = &store->entries[store->entries_count++];
+		snprintf(entry->key, sizeof(entry->key), "%s", key);
+	}
+
+	snprintf(entry->value, sizeof(entry->value), "%s", value);
+}
+
+static int store_load(struct store* store, const char* id) {
+	char dir[CACHE_PATH_MAXLEN - 64];
+	char line[CACHE_KEY_MAXLEN + CACHE_VALUE_MAXLEN + 2];
+	char* name;
+	FILE* file;
+
+	store->entries_count = 0;
+	*store->path = 0;
+
+	if (cache_dir(dir, sizeof(dir)) == -1) {
+		return -1;
+	}
+
+	snprintf(store->path, sizeof(store->path), "%s/%.63s", dir, id);
+	for (name = store->path + strlen(dir) + 1; *name; name++) {
+		if (!isalnum((unsigned char)*name) && *name != '-' && *name != '.') {
+			*name = '_';
+		}
+	}
+
+	file = fopen(store->path, "r");
+	if (NULL == file) {
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char* value = strchr(line, '=');
+
+		if (NULL == value) {
+			continue;
+		}
+
+		*value++ = 0;
+		value[strcspn(value, "\n")] = 0;
+		store_set(store, line, value);
+	}
+
+	fclose(file);
+
+#	ifdef DEBUG
+	printf("Cache %s loaded, %d entries\n", store->path, store->entries_count);
+#	endif
+
+	return 0;
+}
+
+static int store_save(struct store* store) {
+	char tmp_path[CACHE_PATH_MAXLEN + 4];
+	FILE* file;
+
+	if (!*store->path) {
+		return -1;
+	}
+
+	// Written aside and renamed, so a crash never leaves truncated state.
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store->path);
+	file = fopen(tmp_path, "w");
+	if (NULL == file) {
+		return -1;
+	}
+
+	for (int i = 0; i < store->entries_count; i++) {
+		fprintf(file, "%s=%s\n", store->entries[i].key, store->entries[i].value);
+	}
+
+	if (EOF == fclose(file) || -1 == rename(tmp_path, store->path)) {
+		remove(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Loads cache file of the device identified by id (any string, it is sanitized to file name)
+ * as the active store. Returns 0 if the file has been read, -1 otherwise. Entries are empty
+ * in the last case and can be filled and saved anyway.
+ */
+int cache_load(const char* id) {
+	return store_load(&active, id);
+}
+
+// Writes entries to the file of the last loaded device. Returns 0 on success, -1 otherwise.
+int cache_save(void) {
+	return store_save(&active);
+}
+
+/**
+ * Copies value of key cached under id to value without switching the active store.
+ * Returns 0 if found, -1 otherwise.
+ */
+int cache_peek(const char* id, const char* key, char* value, size_t size) {
+	struct store store;
+	struct entry* entry;
+
+	if (-1 == store_load(&store, id) || NULL == (entry = store_find(&store, key))) {
+		return -1;
+	}
+
+	snprintf(value, size, "%s", entry->value);
+
+	return 0;
+}
+
+// Sets key cached under id and saves it without switching the active store. Returns 0 on success, -1 otherwise.
+int cache_put(const char* id, const char* key, const char* value) {
+	struct store store;
+
+	store_load(&store, id);
+	store_set(&store, key, value);
+
+	return store_save(&store);
+}
+
+// Returns value of key or NULL if missing.
+const char* cache_get(const char* key) {
+	struct entry* entry = store_find(&active, key);
+
+	return NULL == entry ? NULL : entry->value;
+}
+
+long cache_get_long(const char* key, long missing) {
+	const char* value = cache_get(key);
+	char* end;
+	long result;
+
+	if (NULL == value) {
+		return missing;
+	}
+
+	result = strtol(value, &end, 10);
+
+	return (end == value || *end) ? missing : result;
+}
+
+void cache_set(const char* key, const char* value) {
+	store_set(&active, key, value);
+}
+
+void cache_set_long(const char* key, long value) {
+	char buffer[24];
+
+	snprintf(buffer, sizeof(buffer), "%ld", value);
+	cache_set(key, buffer);
+}
@@ -0,0 +1,23 @@
+// Per device state kept between runs.
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+#define CACHE_DIR "autolight"
+#define CACHE_MAX_ENTRIES 32
+#define CACHE_KEY_MAXLEN 32
+#define CACHE_VALUE_MAXLEN 128
+#define CACHE_PATH_MAXLEN 512
+
+int cache_load(const char*);
+int cache_save(void);
+int cache_peek(const char*, const char*, char*, size_t);
+int cache_put(const char*, const char*, const char*);
+const char* cache_get(const char*);
+long cache_get_long(const char*, long);
+void cache_set(const char*, const char*);
+void cache_set_long(const char*, long);
+
+#endif
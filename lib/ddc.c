@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glob.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include "ddc.h"
+#include "background.h"
+
+struct ddc_monitor {
+	char path[DDC_PATH_MAXLEN];
+	int fd;
+	long max;
+	// Last written or read level, -1 if unknown.
+	long level;
+	// Level is read again before it is trusted after this time.
+	struct timespec level_expires;
+	// Latest requested level not written yet, -1 if none.
+	long pending;
+	// Next write is not sent before this time.
+	struct timespec next_write;
+	// Error is reported once until the monitor accepts a write again.
+	int failed;
+};
+
+static struct ddc_monitor monitors[DDC_MAX_MONITORS];
+static int monitors_count = 0;
+static pthread_t writer;
+static int writer_started = 0;
+// Protects monitors, requested, rescan and stop.
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond;
+static int stop = 0;
+// Monitors were probed, so they can be scanned again.
+static int scanning = 0;
+static int rescan = 0;
+// Latest value passed to ddc_backlight_set(), -1 if none. Monitors found by a rescan get it.
+static long requested = -1;
+
+// Prefixes of names of I2C adapters driving display connectors.
+static const char* display_adapters[] = {"DPMST", "i915 gmbus", "AMDGPU DM", NULL};
+static const unsigned char edid_header[DDC_EDID_HEADER_LEN] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+
+static void sleep_ms(long ms) {
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+
+	while (-1 == nanosleep(&ts, &ts) && EINTR == errno);
+}
+
+static int later(const struct timespec* a, const struct timespec* b) {
+	return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+// Sets ts to ms milliseconds after now.
+static void after_ms(struct timespec* ts, const struct timespec* now, long ms) {
+	ts->tv_sec = now->tv_sec + ms / 1000;
+	ts->tv_nsec = now->tv_nsec + (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static unsigned char checksum(unsigned char initial, const unsigned char* data, int length) {
+	for (int i = 0; i < length; i++) {
+		initial ^= data[i];
+	}
+
+	return initial;
+}
+
+// Sends DDC/CI message with payload of at most 32 bytes.
+static int ddc_request(int fd, const unsigned char* payload, int length) {
+	unsigned char message[35];
+
+	message[0] = DDC_HOST_ADDRESS;
+	message[1] = 0x80 | length;
+	memcpy(message + 2, payload, length);
+	message[length + 2] = checksum(DDC_DISPLAY_ADDRESS, message, length + 2);
+
+	return write(fd, message, length + 3) == length + 3 ? 0 : -1;
+}
+
+// Returns brightness maximum the monitor reports, -1 on error. current receives the current level.
+static long ddc_get_max(int fd, long* current) {
+	unsigned char request[] = {0x01, DDC_VCP_BRIGHTNESS};
+	unsigned char reply[11];
+
+	if (-1 == ddc_request(fd, request, sizeof(request))) {
+		return -1;
+	}
+
+	sleep_ms(DDC_REPLY_DELAY_MS);
+
+	// Source address, length, Get VCP Feature reply opcode, result, code, type, max, current, checksum.
+	if (read(fd, reply, sizeof(reply)) != sizeof(reply) || reply[2] != 0x02 || reply[3] != 0 ||
+		reply[4] != DDC_VCP_BRIGHTNESS || checksum(DDC_REPLY_ADDRESS, reply, 10) != reply[10]) {
+		return -1;
+	}
+
+	*current = reply[8] << 8 | reply[9];
+
+	return reply[6] << 8 | reply[7];
+}
+
+/**
+ * Returns 1 if the I2C adapter (e.g. "i2c-4") drives a display connector: it is the DDC adapter
+ * of a DRM connector or named like display adapters. Other buses (SMBus, sensors, touchpads)
+ * are never written to.
+ */
+static int ddc_display_adapter(const char* adapter) {
+	char path[PATH_MAX], target[PATH_MAX], name[DDC_PATH_MAXLEN] = "";
+	glob_t found;
+	int display = 0;
+	FILE* file;
+
+	if (0 == glob(DDC_CONNECTOR_PATTERN, 0, NULL, &found)) {
+		for (size_t i = 0; i < found.gl_pathc && !display; i++) {
+			display = NULL != realpath(found.gl_pathv[i], target) && strcmp(basename(target), adapter) == 0;
+		}
+	}
+	globfree(&found);
+
+	if (display) {
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), DDC_ADAPTER_NAME, adapter);
+	file = fopen(path, "r");
+	if (NULL == file) {
+		return 0;
+	}
+	if (NULL == fgets(name, sizeof(name), file)) {
+		name[0] = 0;
+	}
+	fclose(file);
+
+	for (int i = 0; NULL != display_adapters[i]; i++) {
+		if (strncmp(name, display_adapters[i], strlen(display_adapters[i])) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Returns 1 if a display answers at the EDID address with a valid EDID header.
+static int ddc_has_edid(int fd) {
+	unsigned char offset = 0;
+	unsigned char header[DDC_EDID_HEADER_LEN];
+
+	if (-1 == ioctl(fd, I2C_SLAVE, DDC_EDID_ADDRESS) || write(fd, &offset, 1) != 1 ||
+		read(fd, header, sizeof(header)) != sizeof(header)) {
+		return 0;
+	}
+
+	return memcmp(header, edid_header, sizeof(header)) == 0;
+}
+
+static int ddc_set(int fd, long level) {
+	unsigned char request[] = {0x03, DDC_VCP_BRIGHTNESS, (level >> 8) & 0xFF, level & 0xFF};
+
+	return ddc_request(fd, request, sizeof(request));
+}
+
+/**
+ * Opens DDC/CI channel. Files which are not I2C adapters (pipes, regular files) are accepted
+ * as stand-ins for testing. If probe is set, a display must answer with its EDID before
+ * DDC/CI is spoken and the monitor must report its brightness maximum.
+ */
+static int ddc_open_monitor(struct ddc_monitor* monitor, const char* path, int probe) {
+	long current;
+
+	snprintf(monitor->path, sizeof(monitor->path), "%s", path);
+
+	monitor->fd = open(path, O_RDWR);
+	if (-1 == monitor->fd) {
+		if (!probe) {
+			fprintf(stderr, "Cannot open '%s': %d, %s\n", path, errno, strerror(errno));
+		}
+		return -1;
+	}
+
+	if (probe && !ddc_has_edid(monitor->fd)) {
+		close(monitor->fd);
+		return -1;
+	}
+
+	if (-1 == ioctl(monitor->fd, I2C_SLAVE, DDC_ADDRESS) && ENOTTY != errno) {
+		if (!probe) {
+			fprintf(stderr, "%s: I2C_SLAVE error %d, %s\n", path, errno, strerror(errno));
+		}
+		close(monitor->fd);
+		return -1;
+	}
+
+	monitor->max = ddc_get_max(monitor->fd, &current);
+	if (monitor->max <= 0) {
+		if (probe) {
+			close(monitor->fd);
+			return -1;
+		}
+
+		fprintf(stderr, "%s: no brightness maximum reported, %d assumed\n", path, DDC_DEFAULT_MAX);
+		monitor->max = DDC_DEFAULT_MAX;
+	}
+
+	monitor->level = -1;
+	monitor->level_expires.tv_sec = 0;
+	monitor->level_expires.tv_nsec = 0;
+	monitor->pending = -1;
+	monitor->next_write.tv_sec = 0;
+	monitor->next_write.tv_nsec = 0;
+	monitor->failed = 0;
+
+#	ifdef DEBUG
+	printf("%s: DDC/CI monitor, brightness maximum %ld\n", path, monitor->max);
+#	endif
+
+	return 0;
+}
+
+// Probes DDC_SCAN_PATTERN adapters of display connectors, returns count of monitors opened to found.
+static int ddc_scan(struct ddc_monitor* found) {
+	glob_t paths;
+	int count = 0;
+
+	if (0 == glob(DDC_SCAN_PATTERN, 0, NULL, &paths)) {
+		for (size_t i = 0; i < paths.gl_pathc && count < DDC_MAX_MONITORS; i++) {
+			const char* adapter = strrchr(paths.gl_pathv[i], '/') + 1;
+
+			if (ddc_display_adapter(adapter) && 0 == ddc_open_monitor(&found[count], paths.gl_pathv[i], 1)) {
+				count++;
+			}
+		}
+	}
+
+	globfree(&paths);
+
+	return count;
+}
+
+// Queues value of range from 0 to 100 to monitor unless the monitor is known to have it.
+static void ddc_queue(struct ddc_monitor* monitor, long value, const struct timespec* now) {
+	long level = value * monitor->max / 100;
+
+	if (level > monitor->max) level = monitor->max;
+	if (level < 0) level = 0;
+
+	// Known level is trusted until it expires, then the writer checks it on the monitor.
+	monitor->pending = level == monitor->level && later(&monitor->level_expires, now) ? -1 : level;
+}
+
+/**
+ * Replaces monitors by freshly probed ones, called by the writer with queue_mutex locked.
+ * Probing takes long, so the mutex is released meanwhile.
+ */
+static void ddc_rescan_monitors(void) {
+	struct ddc_monitor found[DDC_MAX_MONITORS];
+	struct timespec now;
+	int count;
+
+	pthread_mutex_unlock(&queue_mutex);
+	count = ddc_scan(found);
+	pthread_mutex_lock(&queue_mutex);
+
+	for (int m = 0; m < monitors_count; m++) {
+		close(monitors[m].fd);
+	}
+
+	memcpy(monitors, found, count * sizeof(*found));
+	monitors_count = count;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int m = 0; m < monitors_count && requested != -1; m++) {
+		ddc_queue(&monitors[m], requested, &now);
+	}
+
+#	ifdef DEBUG
+	printf("DDC/CI rescan found %d monitors\n", monitors_count);
+#	endif
+}
+
+/**
+ * Writes the latest pending level of every monitor, not sooner than DDC_WRITE_INTERVAL_MS
+ * after the previous write to the same monitor. Level equal to the expired known one is read
+ * first and written only if the monitor reports another one. Rescans requested by ddc_rescan()
+ * are done here too, they block the bus anyway. Exits when stopped and nothing is pending.
+ */
+static void* writer_main(void* arg) {
+	background_idle();
+
+	pthread_mutex_lock(&queue_mutex);
+
+	for (;;) {
+		struct ddc_monitor* due = NULL;
+		struct timespec now, wake;
+		int waiting = 0;
+
+		if (rescan && !stop) {
+			rescan = 0;
+			ddc_rescan_monitors();
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (int m = 0; m < monitors_count && NULL == due; m++) {
+			struct ddc_monitor* monitor = &monitors[m];
+
+			if (monitor->pending == -1) {
+				continue;
+			}
+
+			if (!later(&monitor->next_write, &now)) {
+				due = monitor;
+			} else if (!waiting || later(&wake, &monitor->next_write)) {
+				wake = monitor->next_write;
+				waiting = 1;
+			}
+		}
+
+		if (NULL != due) {
+			long level = due->pending;
+			long current = -1;
+			int check = level == due->level;
+			int result;
+
+			due->pending = -1;
+			pthread_mutex_unlock(&queue_mutex);
+
+			if (!check || -1 == ddc_get_max(due->fd, &current) || current != level) {
+#				ifdef DEBUG
+				if (check && -1 != current) {
+					printf("%s: brightness changed to %ld on the monitor\n", due->path, current);
+				}
+#				endif
+				result = ddc_set(due->fd, level);
+			} else {
+				result = 0;
+			}
+
+			if (-1 == result && !due->failed) {
+				fprintf(stderr, "%s: DDC/CI Set VCP Feature failed: %s\n", due->path, strerror(errno));
+			}
+
+#			ifdef DEBUG
+			printf("%s: brightness %ld of %ld%s\n", due->path, level, due->max, -1 == result ? " failed" : "");
+#			endif
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			pthread_mutex_lock(&queue_mutex);
+
+			due->failed = -1 == result;
+			due->level = -1 == result ? -1 : level;
+			after_ms(&due->next_write, &now, DDC_WRITE_INTERVAL_MS);
+			after_ms(&due->level_expires, &now, DDC_LEVEL_TIMEOUT_MS);
+		} else if (waiting) {
+			pthread_cond_timedwait(&queue_cond, &queue_mutex, &wake);
+		} else if (stop) {
+			break;
+		} else {
+			pthread_cond_wait(&queue_cond, &queue_mutex);
+		}
+	}
+
+	pthread_mutex_unlock(&queue_mutex);
+
+	return NULL;
+}
+
+/**
+ * paths - comma separated list of I2C device files, NULL or empty to probe DDC_SCAN_PATTERN
+ * adapters of display connectors. Returns -1 if no monitor is usable. Probed monitors can be
+ * scanned again by ddc_rescan() even if none is found now.
+ */
+int ddc_init(char* paths) {
+	char names[DDC_PATH_MAXLEN * DDC_MAX_MONITORS];
+	char *name, *saveptr;
+	pthread_condattr_t attr;
+
+	requested = -1;
+
+	if (NULL == paths || 0 == *paths) {
+		monitors_count = ddc_scan(monitors);
+		scanning = 1;
+	} else {
+		snprintf(names, sizeof(names), "%s", paths);
+
+		for (name = strtok_r(names, ",", &saveptr); NULL != name && monitors_count < DDC_MAX_MONITORS;
+			name = strtok_r(NULL, ",", &saveptr)) {
+			if (0 == ddc_open_monitor(&monitors[monitors_count], name, 0)) {
+				monitors_count++;
+			}
+		}
+	}
+
+	if (0 == monitors_count) {
+		fprintf(stderr, "No usable DDC/CI monitor\n");
+		if (!scanning) {
+			return -1;
+		}
+	}
+
+	// Rate limit deadlines are monotonic.
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&queue_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (0 != pthread_create(&writer, NULL, writer_main, NULL)) {
+		fprintf(stderr, "Cannot create DDC/CI thread\n");
+		exit(EXIT_FAILURE);
+	}
+	writer_started = 1;
+
+	return monitors_count ? 0 : -1;
+}
+
+// Probes monitors again on the writer thread, so the caller isn't blocked. Ignored unless monitors were probed.
+void ddc_rescan(void) {
+	pthread_mutex_lock(&queue_mutex);
+	if (scanning) {
+		rescan = 1;
+		pthread_cond_signal(&queue_cond);
+	}
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+/**
+ * Queues brightness of every monitor, value in range from 0 to 100. Never blocks on the bus:
+ * a level still waiting to be written is replaced by the latest one.
+ * Returns 1 if there is a monitor, -1 otherwise.
+ */
+int ddc_backlight_set(long value) {
+	struct timespec now;
+	int count;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&queue_mutex);
+
+	requested = value;
+	count = monitors_count;
+	for (int m = 0; m < monitors_count; m++) {
+		ddc_queue(&monitors[m], value, &now);
+	}
+
+	if (count) {
+		pthread_cond_signal(&queue_cond);
+	}
+	pthread_mutex_unlock(&queue_mutex);
+
+	return count ? 1 : -1;
+}
+
+// Writes pending levels and closes monitors.
+void ddc_close(void) {
+	if (!writer_started) {
+		return;
+	}
+
+	pthread_mutex_lock(&queue_mutex);
+	stop = 1;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+
+	pthread_join(writer, NULL);
+	pthread_cond_destroy(&queue_cond);
+
+	for (int m = 0; m < monitors_count; m++) {
+		close(monitors[m].fd);
+	}
+
+	monitors_count = 0;
+	writer_started = 0;
+	scanning = 0;
+	rescan = 0;
+	stop = 0;
+}
@@ -0,0 +1,37 @@
+// DDC/CI (VESA MCCS) brightness control of external monitors.
+
+#ifndef DDC_H
+#define DDC_H
+
+#define DDC_MAX_MONITORS 8
+#define DDC_PATH_MAXLEN 64
+#define DDC_SCAN_PATTERN "/dev/i2c-*"
+// DRM connectors link their DDC adapter, DP MST adapters are only known by name.
+#define DDC_CONNECTOR_PATTERN "/sys/class/drm/*/ddc"
+#define DDC_ADAPTER_NAME "/sys/bus/i2c/devices/%s/name"
+// 7 bit I2C slave address of DDC/CI.
+#define DDC_ADDRESS 0x37
+// EDID EEPROM every display answers at.
+#define DDC_EDID_ADDRESS 0x50
+#define DDC_EDID_HEADER_LEN 8
+#define DDC_HOST_ADDRESS 0x51
+#define DDC_DISPLAY_ADDRESS 0x6E
+// Virtual host address replies are checksummed with.
+#define DDC_REPLY_ADDRESS 0x50
+#define DDC_VCP_BRIGHTNESS 0x10
+// Monitor needs this long to prepare Get VCP Feature reply.
+#define DDC_REPLY_DELAY_MS 40
+// Monitors drop writes coming faster than this.
+#define DDC_WRITE_INTERVAL_MS 200
+// Level written or read this long ago is read again before it is trusted, so changes made
+// on the monitor itself (OSD buttons) get corrected.
+#define DDC_LEVEL_TIMEOUT_MS 10000
+// Used if the monitor doesn't report brightness maximum.
+#define DDC_DEFAULT_MAX 100
+
+int ddc_init(char*);
+int ddc_backlight_set(long);
+void ddc_rescan(void);
+void ddc_close(void);
+
+#endif
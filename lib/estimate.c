@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "estimate.h"
+#include "luma.h"
+
+// Confidence interval half width in range from 0 to 1, 0 disables early termination.
+static double tolerance = 0;
+static unsigned long long touched_units = 0;
+static unsigned long long total_units = 0;
+
+/**
+ * percents - frames are processed until the confidence interval of the mean
+ * is narrower than +-percents of full scale.
+ */
+void estimate_init(double percents) {
+	tolerance = percents / 100;
+}
+
+// Returns half width of the confidence interval at which frames are finished, 0 if disabled.
+double estimate_tolerance(void) {
+	return tolerance;
+}
+
+void estimate_reset(struct estimate* estimate) {
+	estimate->sum = 0;
+	estimate->pixels = 0;
+	estimate->parts = 0;
+	estimate->last = 0;
+	estimate->d2 = 0;
+}
+
+// Adds part having sum of pixels brightness in LUMA_ONE fixed point.
+void estimate_add(struct estimate* estimate, unsigned long long sum, unsigned long long pixels) {
+	double value;
+
+	if (!pixels) {
+		return;
+	}
+
+	value = luma_mean(sum, pixels);
+
+	if (estimate->parts) {
+		estimate->d2 += (value - estimate->last) * (value - estimate->last);
+	}
+
+	estimate->sum += sum;
+	estimate->pixels += pixels;
+	estimate->parts++;
+	estimate->last = value;
+}
+
+/**
+ * Returns half width of the confidence interval of the mean if sampled of parts in the frame
+ * were sampled with the same variance. Finite population correction makes it 0 when every part is sampled.
+ */
+double estimate_predict(const struct estimate* estimate, int sampled, int parts) {
+	double variance;
+
+	if (estimate->parts < 2 || sampled < 1) {
+		return 1;
+	}
+
+	// Successive difference estimator: neighbour parts of systematic samples don't
+	// count frame gradients as noise, parts far apart estimate plain sample variance.
+	variance = estimate->d2 / (2.0 * (estimate->parts - 1));
+
+	if (parts > sampled) {
+		variance *= 1 - (double)sampled / parts;
+	} else {
+		variance = 0;
+	}
+
+	return ESTIMATE_Z * sqrt(variance / sampled);
+}
+
+// Returns half width of the confidence interval of the mean, parts - count of parts in the frame.
+double estimate_halfwidth(const struct estimate* estimate, int parts) {
+	return estimate_predict(estimate, estimate->parts, parts);
+}
+
+/**
+ * Returns count of parts sampled before the interval is trusted. A few parts of a dark frame
+ * agree perfectly while missing a small bright region, so the count grows with the frame.
+ */
+int estimate_min_parts(int parts) {
+	int min = (int)ceil(sqrt(parts));
+
+	return min > ESTIMATE_MIN_PARTS ? min : ESTIMATE_MIN_PARTS;
+}
+
+int estimate_converged(const struct estimate* estimate, int parts) {
+	return tolerance > 0 && estimate->parts >= estimate_min_parts(parts) &&
+		estimate_halfwidth(estimate, parts) < tolerance;
+}
+
+// Returns bits count of the smallest power of two not less than parts.
+unsigned int estimate_bits(unsigned int parts) {
+	unsigned int bits = 0;
+
+	while ((1U << bits) < parts) {
+		bits++;
+	}
+
+	return bits;
+}
+
+/**
+ * Returns step reversed in bits. Visiting parts in order of reversed steps 0, 1, ... 2^bits - 1,
+ * skipping values not less than parts count, spreads the first steps evenly over the frame
+ * (stratified sampling).
+ */
+unsigned int estimate_reverse(unsigned int step, unsigned int bits) {
+	unsigned int reversed = 0;
+
+	for (unsigned int b = 0; b < bits; b++) {
+		if (step & (1U << b)) {
+			reversed |= 1U << (bits - 1 - b);
+		}
+	}
+
+	return reversed;
+}
+
+// Accounts processed share of frame, in any units (rows, pixels).
+void estimate_account(unsigned long long touched, unsigned long long total) {
+	touched_units += touched;
+	total_units += total;
+}
+
+// Returns processed share of all frames in range from 0 to 1.
+double estimate_touched(void) {
+	return total_units ? (double)touched_units / total_units : 1.0;
+}
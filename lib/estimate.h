@@ -0,0 +1,36 @@
+// Early terminating estimation of frame mean brightness.
+
+#ifndef ESTIMATE_H
+#define ESTIMATE_H
+
+// Two sided 95% confidence.
+#define ESTIMATE_Z 1.96
+// Parts sampled before the interval is trusted, at least square root of parts in the frame.
+#define ESTIMATE_MIN_PARTS 4
+// Sampled frames without restart intervals skip at most this many bands of every ESTIMATE_MAX_STRIDE.
+#define ESTIMATE_MAX_STRIDE 16
+
+// Running statistics of sampled parts (rows, bands or restart segments) of a frame.
+struct estimate {
+	unsigned long long sum;
+	unsigned long long pixels;
+	int parts;
+	// Last part mean and sum of squared differences of successive part means.
+	double last;
+	double d2;
+};
+
+void estimate_init(double);
+double estimate_tolerance(void);
+void estimate_reset(struct estimate*);
+void estimate_add(struct estimate*, unsigned long long, unsigned long long);
+double estimate_predict(const struct estimate*, int, int);
+double estimate_halfwidth(const struct estimate*, int);
+int estimate_min_parts(int);
+int estimate_converged(const struct estimate*, int);
+unsigned int estimate_bits(unsigned int);
+unsigned int estimate_reverse(unsigned int, unsigned int);
+void estimate_account(unsigned long long, unsigned long long);
+double estimate_touched(void);
+
+#endif
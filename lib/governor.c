@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "governor.h"
+
+static const struct operating_point ladder[] = {
+	{1, 1, 1}, {1, 2, 1}, {1, 4, 1}, {1, 8, 1},
+	{2, 8, 1}, {4, 8, 1},
+	{4, 8, 2}, {4, 8, 4}, {4, 8, 8}, {4, 8, 16}
+};
+
+#define LADDER_SIZE ((int)(sizeof(ladder) / sizeof(*ladder)))
+
+// Budget in share of one core, 0 if governor is off.
+static double budget = 0;
+static long base_interval_ms = 0;
+static int level = 0;
+static double usage = 0;
+// Measured CPU time per sample of every level, 0 if unknown.
+static double costs[LADDER_SIZE];
+
+static struct {
+	double cpu;
+	double wall;
+	long samples;
+} window;
+
+static double clock_seconds(clockid_t clock) {
+	struct timespec ts;
+
+	if (-1 == clock_gettime(clock, &ts)) {
+		return 0;
+	}
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * percents - CPU budget in percents of one core, 0 turns governor off.
+ * interval_ms - sampling interval of the most accurate operating point.
+ */
+void governor_init(double percents, long interval_ms) {
+	budget = percents / 100;
+	base_interval_ms = interval_ms > 0 ? interval_ms : 1;
+	level = 0;
+	usage = 0;
+	memset(costs, 0, sizeof(costs));
+	governor_start();
+}
+
+// Starts new measuring window, work done before (e.g. calibration) is not accounted.
+void governor_start(void) {
+	window.cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+	window.wall = clock_seconds(CLOCK_MONOTONIC);
+	window.samples = 0;
+}
+
+// Predicted share of core used at level.
+static double predict(int at) {
+	double cost = costs[at];
+
+	if (cost <= 0) {
+		// Unmeasured more accurate point: assume it doubles the cost of a sample.
+		cost = costs[level] * (at < level ? 2 : 1);
+	}
+
+	return cost / (base_interval_ms * ladder[at].interval_multiplier / 1000.0);
+}
+
+/**
+ * Accounts one sample. Returns 1 if operating point has changed and must be applied, 0 otherwise.
+ */
+int governor_update(void) {
+	double cpu, wall;
+	int previous = level;
+
+	if (budget <= 0) {
+		return 0;
+	}
+
+	window.samples++;
+	cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+	wall = clock_seconds(CLOCK_MONOTONIC);
+
+	if (window.samples < GOVERNOR_WINDOW_SAMPLES || (wall - window.wall) * 1000 < GOVERNOR_WINDOW_MS) {
+		return 0;
+	}
+
+	usage = (cpu - window.cpu) / (wall - window.wall);
+	costs[level] = (cpu - window.cpu) / window.samples;
+
+	if (usage > budget && level < LADDER_SIZE - 1) {
+		level++;
+	} else if (usage < budget && level > 0 && predict(level - 1) < budget * GOVERNOR_UP_MARGIN) {
+		level--;
+	}
+
+	governor_start();
+
+	if (level != previous) {
+		fprintf(stderr, "Governor: cpu %.3f%% of %.3f%% budget, operating point %d (size 1/%d, scale 1/%d, interval %ldms)\n",
+			usage * 100, budget * 100, level, ladder[level].size_divisor, ladder[level].scale_denom,
+			base_interval_ms * ladder[level].interval_multiplier);
+		return 1;
+	}
+
+	return 0;
+}
+
+const struct operating_point* governor_point(void) {
+	return &ladder[level];
+}
+
+int governor_level(void) {
+	return level;
+}
+
+// Returns share of one core used over the last complete window.
+double governor_usage(void) {
+	return usage;
+}
@@ -0,0 +1,26 @@
+// CPU budget governor.
+
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+// CPU usage is evaluated over windows at least this long and this many samples.
+#define GOVERNOR_WINDOW_MS 5000
+#define GOVERNOR_WINDOW_SAMPLES 3
+// Move to more accurate point only if its predicted usage fits this share of budget.
+#define GOVERNOR_UP_MARGIN 0.7
+
+// Accuracy is traded in order: decode scale, capture size and then sampling interval.
+struct operating_point {
+	int size_divisor;
+	int scale_denom;
+	int interval_multiplier;
+};
+
+void governor_init(double, long);
+void governor_start(void);
+int governor_update(void);
+const struct operating_point* governor_point(void);
+int governor_level(void);
+double governor_usage(void);
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "hotplug.h"
+
+// Multicast group of uevents sent by the kernel itself.
+#define KERNEL_GROUP 1
+
+static int sock = -1;
+
+/**
+ * Returns event flag of the uevent message "ACTION@DEVPATH\0KEY=VALUE\0...", 0 if it doesn't matter:
+ * video4linux and i2c-dev devices added or removed, DRM connectors hotplugged (monitor plugged).
+ * Other DRM changes (mode sets, DPMS) lack HOTPLUG=1 and are ignored.
+ */
+static int parse_uevent(const char* message, int length) {
+	const char* action = "";
+	const char* subsystem = "";
+	int connector_hotplug = 0;
+
+	for (int i = 0; i < length; i += strlen(message + i) + 1) {
+		if (strncmp(message + i, "ACTION=", 7) == 0) {
+			action = message + i + 7;
+		} else if (strncmp(message + i, "SUBSYSTEM=", 10) == 0) {
+			subsystem = message + i + 10;
+		} else if (strcmp(message + i, "HOTPLUG=1") == 0) {
+			connector_hotplug = 1;
+		}
+	}
+
+	if (strcmp(subsystem, "drm") == 0) {
+		return strcmp(action, "change") == 0 && connector_hotplug ? HOTPLUG_DRM : 0;
+	}
+
+	if (strcmp(action, "add") != 0 && strcmp(action, "remove") != 0) {
+		return 0;
+	}
+
+	if (strcmp(subsystem, "video4linux") == 0) {
+		return HOTPLUG_VIDEO;
+	}
+
+	if (strcmp(subsystem, "i2c-dev") == 0) {
+		return HOTPLUG_I2C;
+	}
+
+	return 0;
+}
+
+// Returns -1 if uevents aren't available (e.g. in a container), callers then rely on probing.
+int hotplug_init(void) {
+	struct sockaddr_nl address;
+
+	sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (-1 == sock) {
+		fprintf(stderr, "Hotplug events unavailable: %d, %s\n", errno, strerror(errno));
+		return -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.nl_family = AF_NETLINK;
+	address.nl_pid = 0;
+	address.nl_groups = KERNEL_GROUP;
+
+	if (-1 == bind(sock, (struct sockaddr*)&address, sizeof(address))) {
+		fprintf(stderr, "Hotplug events unavailable: %d, %s\n", errno, strerror(errno));
+		close(sock);
+		sock = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Reads queued uevents without blocking, returns flags of the relevant ones.
+int hotplug_poll(void) {
+	char message[HOTPLUG_MESSAGE_MAXLEN];
+	int events = 0;
+	ssize_t length;
+
+	if (-1 == sock) {
+		return 0;
+	}
+
+	while ((length = recv(sock, message, sizeof(message) - 1, 0)) > 0) {
+		message[length] = 0;
+		events |= parse_uevent(message, length);
+	}
+
+#	ifdef DEBUG
+	if (events) {
+		printf("Hotplug events %d\n", events);
+	}
+#	endif
+
+	return events;
+}
+
+// Waits up to timeout_ms for a relevant uevent, returns flags of events read.
+int hotplug_wait(long timeout_ms) {
+	struct pollfd pfd;
+	struct timespec start, now;
+	long left = timeout_ms;
+	int events = 0;
+
+	if (-1 == sock) {
+		struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000};
+
+		while (-1 == nanosleep(&ts, &ts) && EINTR == errno);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+
+	// Unrelated uevents (power supply, network...) don't end the wait.
+	while (!events && left > 0) {
+		if (poll(&pfd, 1, left) > 0) {
+			events = hotplug_poll();
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+	}
+
+	return events;
+}
+
+void hotplug_close(void) {
+	if (-1 != sock) {
+		close(sock);
+		sock = -1;
+	}
+}
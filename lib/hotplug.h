@@ -0,0 +1,17 @@
+// Kernel uevents of devices coming and going.
+
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#define HOTPLUG_MESSAGE_MAXLEN 8192
+// Events, returned as flags.
+#define HOTPLUG_VIDEO 1
+#define HOTPLUG_I2C 2
+#define HOTPLUG_DRM 4
+
+int hotplug_init(void);
+int hotplug_poll(void);
+int hotplug_wait(long);
+void hotplug_close(void);
+
+#endif
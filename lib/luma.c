@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "luma.h"
+
+// Per channel contribution of every 8 bit level, in LUMA_ONE fixed point.
+// Channel coefficients and optional sRGB linearization are folded in at init,
+// so a pixel costs three lookups and two adds.
+static unsigned int tables[3][LUMA_LEVELS];
+// Square root applied to the per pixel sum when quadratic is set.
+static unsigned int post[(1 << LUMA_POST_BITS) + 1];
+// Brightness of every limited range luma (Y) level, chroma is ignored.
+static unsigned int luma_y[LUMA_LEVELS];
+static int quadratic;
+
+// sRGB electro-optical transfer function, input and output in range from 0 to 1.
+static double srgb_to_linear(double value) {
+	if (value <= 0.04045) {
+		return value / 12.92;
+	}
+
+	return pow((value + 0.055) / 1.055, 2.4);
+}
+
+static unsigned char clip(int value) {
+	return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+// Expands limited range luma to 8 bit levels.
+static unsigned char full_range(int y) {
+	return clip((298 * (y - 16) + 128) >> 8);
+}
+
+/**
+ * Builds the lookup tables.
+ * r, g, b - channel coefficients, normalized to sum of 1.
+ * squared - sqrt(r * R^2 + g * G^2 + b * B^2) instead of r * R + g * G + b * B.
+ * linear - convert gamma encoded sRGB values to linear light before weighting.
+ */
+void luma_init(double r, double g, double b, int squared, int linear) {
+	double coefficients[3] = {r, g, b};
+	double total = r + g + b;
+
+	if (r < 0 || g < 0 || b < 0 || total <= 0) {
+		fprintf(stderr, "Invalid brightness coefficients %g,%g,%g\n", r, g, b);
+		exit(EXIT_FAILURE);
+	}
+
+	quadratic = squared;
+
+	for (int c = 0; c < 3; c++) {
+		for (int level = 0; level < LUMA_LEVELS; level++) {
+			double value = (double)level / (LUMA_LEVELS - 1);
+
+			if (linear) {
+				value = srgb_to_linear(value);
+			}
+			if (quadratic) {
+				value *= value;
+			}
+
+			// Rounding down keeps the sum of three channels within LUMA_ONE.
+			tables[c][level] = (unsigned int)floor(coefficients[c] / total * value * LUMA_ONE);
+		}
+	}
+
+	if (quadratic) {
+		for (int i = 0; i <= (1 << LUMA_POST_BITS); i++) {
+			post[i] = (unsigned int)(sqrt((double)i / (1 << LUMA_POST_BITS)) * LUMA_ONE + 0.5);
+		}
+	}
+
+	// Y is metered as the gray pixel of the same level.
+	for (int y = 0; y < LUMA_LEVELS; y++) {
+		unsigned char gray[3];
+
+		gray[0] = gray[1] = gray[2] = full_range(y);
+		luma_y[y] = (unsigned int)luma_sum(gray, 1);
+	}
+}
+
+// Returns sum of pixels brightness in LUMA_ONE fixed point. Pixels follow in the format RGB.
+unsigned long long luma_sum(const unsigned char* rgb, unsigned int pixels) {
+	unsigned long long sum = 0;
+	const unsigned int* R = tables[0];
+	const unsigned int* G = tables[1];
+	const unsigned int* B = tables[2];
+
+	if (quadratic) {
+		for (unsigned int i = 0; i < pixels; i++, rgb += 3) {
+			unsigned int value = R[rgb[0]] + G[rgb[1]] + B[rgb[2]];
+
+			sum += post[(value + (1 << (LUMA_FRAC_BITS - LUMA_POST_BITS - 1))) >> (LUMA_FRAC_BITS - LUMA_POST_BITS)];
+		}
+	} else {
+		for (unsigned int i = 0; i < pixels; i++, rgb += 3) {
+			sum += R[rgb[0]] + G[rgb[1]] + B[rgb[2]];
+		}
+	}
+
+	return sum;
+}
+
+// Returns value in range from 0 to 1.
+double luma_mean(unsigned long long sum, unsigned long long pixels) {
+	if (!pixels) {
+		return 0.0;
+	}
+
+	return (double)sum / pixels / LUMA_ONE;
+}
+
+// ITU-R BT.601 limited range YCbCr to RGB.
+static void yuv_to_rgb(int y, int u, int v, unsigned char* rgb) {
+	int c = 298 * (y - 16) + 128;
+
+	rgb[0] = clip((c + 409 * (v - 128)) >> 8);
+	rgb[1] = clip((c - 100 * (u - 128) - 208 * (v - 128)) >> 8);
+	rgb[2] = clip((c + 516 * (u - 128)) >> 8);
+}
+
+// Converts pixels in the format YUYV (two pixels share chroma) to RGB.
+void luma_yuyv_to_rgb(const unsigned char* yuyv, unsigned char* rgb, unsigned int pixels) {
+	for (unsigned int i = 0; i + 1 < pixels; i += 2, yuyv += 4, rgb += 6) {
+		yuv_to_rgb(yuyv[0], yuyv[1], yuyv[3], rgb);
+		yuv_to_rgb(yuyv[2], yuyv[1], yuyv[3], rgb + 3);
+	}
+}
+
+/**
+ * The same as luma_sum() for pixels in the format YUYV. Only luma is read, every pixel costs a lookup:
+ * the result is exact for gray scenes and close for the weakly saturated colors of a lit room.
+ */
+unsigned long long luma_yuyv_sum(const unsigned char* yuyv, unsigned int pixels) {
+	unsigned long long sum = 0;
+
+	for (unsigned int i = 0; i < pixels; i++, yuyv += 2) {
+		sum += luma_y[yuyv[0]];
+	}
+
+	return sum;
+}
@@ -0,0 +1,18 @@
+// Table driven luminance engine.
+
+#ifndef LUMA_H
+#define LUMA_H
+
+#define LUMA_LEVELS 256
+#define LUMA_FRAC_BITS 16
+#define LUMA_ONE (1 << LUMA_FRAC_BITS)
+// Resolution of the square root table used by the quadratic (OPT2) algorithm.
+#define LUMA_POST_BITS 14
+
+void luma_init(double, double, double, int, int);
+unsigned long long luma_sum(const unsigned char*, unsigned int);
+unsigned long long luma_yuyv_sum(const unsigned char*, unsigned int);
+void luma_yuyv_to_rgb(const unsigned char*, unsigned char*, unsigned int);
+double luma_mean(unsigned long long, unsigned long long);
+
+#endif
@@ -0,0 +1,621 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <jpeglib.h>
+#include "mjpeg.h"
+#include "luma.h"
+#include "estimate.h"
+
+#define MARKER_SOF0 0xC0
+#define MARKER_SOF1 0xC1
+#define MARKER_SOF15 0xCF
+#define MARKER_DHT 0xC4
+#define MARKER_DAC 0xCC
+#define MARKER_RST0 0xD0
+#define MARKER_RST7 0xD7
+#define MARKER_SOI 0xD8
+#define MARKER_EOI 0xD9
+#define MARKER_SOS 0xDA
+#define MARKER_DRI 0xDD
+#define MARKER_TEM 0x01
+
+// Frame geometry needed to split entropy coded data at restart markers.
+struct layout {
+	unsigned long scan;
+	unsigned long sof;
+	unsigned int restart_interval;
+	unsigned int height;
+	unsigned int mcus_per_row;
+	unsigned int mcu_rows;
+	unsigned int mcu_height;
+};
+
+// Run of whole restart intervals starting at MCU row boundary.
+// start and end are offsets of entropy coded data, first_row and rows are output scanlines.
+struct task {
+	unsigned long start;
+	unsigned long end;
+	unsigned int first_row;
+	unsigned int rows;
+};
+
+struct worker {
+	pthread_t thread;
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned char* buffer;
+	unsigned long buffer_size;
+	unsigned char* row;
+	unsigned long row_size;
+};
+
+static struct {
+	const unsigned char* data;
+	const struct layout* layout;
+	struct task tasks[MJPEG_MAX_TASKS];
+	int tasks_count;
+	// Tasks are started in bit reversed order of steps, see estimate_reverse().
+	unsigned int order_bits;
+	unsigned int next_step;
+	int started_tasks;
+	int done_tasks;
+	struct estimate estimate;
+	int converged;
+	unsigned long long touched_rows;
+	unsigned long generation;
+	int stop;
+} job;
+
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static struct worker workers[MJPEG_MAX_THREADS];
+static int workers_count = 0;
+// Metering output is 1/scale_denom of frame size.
+static int scale_denom = 1;
+// Frames without restart intervals meter one of every sample_stride bands while estimating.
+static unsigned int sample_stride = 1;
+// Metered band of every stride rotates from frame to frame, so still scenes don't bias the mean.
+static unsigned int sample_phase = 0;
+
+static void* grow(void* buffer, unsigned long* size, unsigned long required) {
+	if (*size >= required) {
+		return buffer;
+	}
+
+	buffer = realloc(buffer, required);
+
+	if (NULL == buffer) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	*size = required;
+	return buffer;
+}
+
+// Returns 0 if frame is a baseline interleaved scan with restart intervals, -1 otherwise.
+static int parse_headers(const unsigned char* data, unsigned long length, struct layout* layout) {
+	unsigned long i = 2;
+	unsigned int width = 0, components = 0;
+	unsigned int h_max = 1, v_max = 1;
+
+	memset(layout, 0, sizeof(*layout));
+
+	if (length < 4 || data[0] != 0xFF || data[1] != MARKER_SOI) {
+		return -1;
+	}
+
+	while (i < length) {
+		unsigned int marker, segment;
+
+		if (data[i] != 0xFF) {
+			return -1;
+		}
+		while (i < length && data[i] == 0xFF) {
+			i++;
+		}
+		if (i + 3 > length) {
+			return -1;
+		}
+
+		marker = data[i++];
+
+		if (marker == MARKER_TEM || (marker >= MARKER_RST0 && marker <= MARKER_RST7)) {
+			continue;
+		}
+
+		segment = (data[i] << 8) | data[i + 1];
+
+		if (segment < 2 || i + segment > length) {
+			return -1;
+		}
+
+		if (marker == MARKER_SOF0 || marker == MARKER_SOF1) {
+			if (segment < 8) {
+				return -1;
+			}
+
+			layout->sof = i + 3;
+			layout->height = (data[i + 3] << 8) | data[i + 4];
+			width = (data[i + 5] << 8) | data[i + 6];
+			components = data[i + 7];
+
+			if (segment < 8 + components * 3) {
+				return -1;
+			}
+
+			for (int c = 0; c < components; c++) {
+				unsigned int sampling = data[i + 9 + c * 3];
+
+				if ((sampling >> 4) > h_max) h_max = sampling >> 4;
+				if ((sampling & 0x0F) > v_max) v_max = sampling & 0x0F;
+			}
+		} else if (marker > MARKER_SOF1 && marker <= MARKER_SOF15 && marker != MARKER_DHT && marker != MARKER_DAC) {
+			// Progressive, lossless and arithmetic coded frames.
+			return -1;
+		} else if (marker == MARKER_DRI) {
+			if (segment < 4) {
+				return -1;
+			}
+			layout->restart_interval = (data[i + 2] << 8) | data[i + 3];
+		} else if (marker == MARKER_SOS) {
+			// Only a single scan with all components can be cut at restart markers.
+			if (!layout->sof || !layout->restart_interval || !layout->height || !width ||
+				data[i + 2] != components) {
+				return -1;
+			}
+
+			if (components == 1) {
+				h_max = v_max = 1;
+			}
+
+			layout->scan = i + segment;
+			layout->mcu_height = v_max * 8;
+			layout->mcus_per_row = (width + h_max * 8 - 1) / (h_max * 8);
+			layout->mcu_rows = (layout->height + layout->mcu_height - 1) / layout->mcu_height;
+
+			return 0;
+		}
+
+		i += segment;
+	}
+
+	return -1;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+	while (b) {
+		unsigned int t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+// Cuts entropy coded data into tasks. Returns count of tasks, 0 if frame can't be split.
+static int split_tasks(const unsigned char* data, unsigned long length, const struct layout* layout, struct task* tasks) {
+	unsigned int interval = layout->restart_interval;
+	unsigned long mcus = (unsigned long)layout->mcus_per_row * layout->mcu_rows;
+	unsigned long intervals = (mcus + interval - 1) / interval;
+	// Intervals between two consecutive MCU row aligned restart markers.
+	unsigned long step = layout->mcus_per_row / gcd(interval, layout->mcus_per_row);
+	unsigned long aligned = (intervals + step - 1) / step;
+	unsigned long stride = step * ((aligned + MJPEG_MAX_TASKS - 1) / MJPEG_MAX_TASKS);
+	unsigned long current = 0;
+	const unsigned char* p = data + layout->scan;
+	const unsigned char* end = data + length;
+	int count = 0;
+
+	if (aligned < 2) {
+		return 0;
+	}
+
+	tasks[count++].start = layout->scan;
+
+	while (p < end && (p = memchr(p, 0xFF, end - p)) != NULL) {
+		if (p + 1 >= end) {
+			break;
+		}
+		if (p[1] == 0x00 || p[1] == 0xFF) {
+			p++;
+			continue;
+		}
+		if (p[1] < MARKER_RST0 || p[1] > MARKER_RST7) {
+			break;
+		}
+
+		if (++current % stride == 0) {
+			if (count == MJPEG_MAX_TASKS) {
+				return 0;
+			}
+			tasks[count - 1].end = p - data;
+			tasks[count++].start = p - data + 2;
+		}
+
+		p += 2;
+	}
+
+	if (current + 1 != intervals) {
+		// Broken or truncated frame, let libjpeg deal with it.
+		return 0;
+	}
+
+	tasks[count - 1].end = (NULL == p || p >= end) ? length : (unsigned long)(p - data);
+
+	for (int t = 0; t < count; t++) {
+		unsigned long first_mcu_row = (t * stride * interval) / layout->mcus_per_row;
+		unsigned long next_mcu_row = ((t + 1) * stride * interval) / layout->mcus_per_row;
+		unsigned int last_row = next_mcu_row * layout->mcu_height;
+
+		if (t == count - 1 || last_row > layout->height) {
+			last_row = layout->height;
+		}
+
+		tasks[t].first_row = first_mcu_row * layout->mcu_height;
+		tasks[t].rows = last_row - tasks[t].first_row;
+	}
+
+	return count;
+}
+
+/**
+ * Decodes JPEG image and returns sum of its pixels brightness, pixels receives metered pixels count.
+ * stride, phase - only bands (iMCU rows) with index equal to phase modulo stride are metered, others are
+ * skipped what saves all the work but entropy decoding. Every metered band is added to estimate, if not NULL.
+ */
+static unsigned long long decode_luma(struct worker* worker, const unsigned char* data, unsigned long length,
+	unsigned long long* pixels, unsigned int stride, unsigned int phase, struct estimate* estimate) {
+	struct jpeg_decompress_struct* cinfo = &worker->cinfo;
+	unsigned long long sum = 0;
+	unsigned char* buffer_array[MJPEG_BATCH_ROWS];
+	unsigned long row_bytes;
+	JDIMENSION band;
+
+	jpeg_mem_src(cinfo, data, length);
+	jpeg_read_header(cinfo, 1);
+	cinfo->out_color_space = JCS_RGB;
+	// Fancy upsampling reads chroma across MCU rows, plain one keeps parts independent and costs less.
+	cinfo->do_fancy_upsampling = FALSE;
+	cinfo->scale_num = 1;
+	cinfo->scale_denom = scale_denom;
+	jpeg_start_decompress(cinfo);
+
+	row_bytes = cinfo->output_width * cinfo->output_components;
+	worker->row = grow(worker->row, &worker->row_size, row_bytes * MJPEG_BATCH_ROWS);
+	for (int i = 0; i < MJPEG_BATCH_ROWS; i++) {
+		buffer_array[i] = worker->row + i * row_bytes;
+	}
+
+	band = (cinfo->output_height + cinfo->total_iMCU_rows - 1) / cinfo->total_iMCU_rows;
+	*pixels = 0;
+
+	for (unsigned int b = 0; cinfo->output_scanline < cinfo->output_height; b++) {
+		JDIMENSION first = cinfo->output_scanline;
+		JDIMENSION last = first + band < cinfo->output_height ? first + band : cinfo->output_height;
+		unsigned long long band_sum = 0;
+
+#		ifdef LIBJPEG_TURBO_VERSION
+		if (b % stride != phase % stride) {
+			jpeg_skip_scanlines(cinfo, last - first);
+			continue;
+		}
+#		endif
+
+		while (cinfo->output_scanline < last) {
+			JDIMENSION wanted = last - cinfo->output_scanline;
+			JDIMENSION rows = jpeg_read_scanlines(cinfo, buffer_array, wanted < MJPEG_BATCH_ROWS ? wanted : MJPEG_BATCH_ROWS);
+
+			band_sum += luma_sum(worker->row, cinfo->output_width * rows);
+		}
+
+		if (NULL != estimate) {
+			estimate_add(estimate, band_sum, (unsigned long long)cinfo->output_width * (last - first));
+		}
+
+		sum += band_sum;
+		*pixels += (unsigned long long)cinfo->output_width * (last - first);
+	}
+
+	jpeg_finish_decompress(cinfo);
+
+	return sum;
+}
+
+// Builds standalone JPEG image from the frame headers and the task entropy coded data.
+static unsigned long long decode_task(struct worker* worker, const struct task* task, unsigned long long* pixels) {
+	const struct layout* layout = job.layout;
+	unsigned long entropy = task->end - task->start;
+	unsigned long length = layout->scan + entropy + 2;
+	unsigned char* image;
+	unsigned char* p;
+	unsigned char* end;
+	unsigned int restart = 0;
+
+	worker->buffer = grow(worker->buffer, &worker->buffer_size, length);
+	image = worker->buffer;
+
+	memcpy(image, job.data, layout->scan);
+	image[layout->sof] = task->rows >> 8;
+	image[layout->sof + 1] = task->rows & 0xFF;
+	memcpy(image + layout->scan, job.data + task->start, entropy);
+	image[length - 2] = 0xFF;
+	image[length - 1] = MARKER_EOI;
+
+	// Decoder expects restart markers numbered from RST0.
+	p = image + layout->scan;
+	end = image + layout->scan + entropy;
+
+	while (p < end && (p = memchr(p, 0xFF, end - p)) != NULL && p + 1 < end) {
+		if (p[1] >= MARKER_RST0 && p[1] <= MARKER_RST7) {
+			p[1] = MARKER_RST0 + (restart++ & 7);
+			p += 2;
+		} else {
+			p++;
+		}
+	}
+
+	return decode_luma(worker, image, length, pixels, 1, 0, NULL);
+}
+
+static void run_tasks(struct worker* worker) {
+	for (;;) {
+		unsigned long long sum, pixels;
+		int task;
+
+		pthread_mutex_lock(&job_mutex);
+		task = -1;
+		while (!job.converged && job.next_step < (1U << job.order_bits) && task == -1) {
+			unsigned int candidate = estimate_reverse(job.next_step++, job.order_bits);
+
+			if (candidate < job.tasks_count) {
+				task = candidate;
+				job.started_tasks++;
+			}
+		}
+		pthread_mutex_unlock(&job_mutex);
+
+		if (task == -1) {
+			break;
+		}
+
+		sum = decode_task(worker, &job.tasks[task], &pixels);
+
+		pthread_mutex_lock(&job_mutex);
+		estimate_add(&job.estimate, sum, pixels);
+		job.touched_rows += job.tasks[task].rows;
+		if (estimate_converged(&job.estimate, job.tasks_count)) {
+			// Tasks already running are finished, no more are started.
+			job.converged = 1;
+		}
+		if (++job.done_tasks == job.started_tasks) {
+			pthread_cond_signal(&done_cond);
+		}
+		pthread_mutex_unlock(&job_mutex);
+	}
+}
+
+static void* worker_main(void* arg) {
+	struct worker* worker = arg;
+	unsigned long generation = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&job_mutex);
+		while (job.generation == generation && !job.stop) {
+			pthread_cond_wait(&job_cond, &job_mutex);
+		}
+		if (job.stop) {
+			pthread_mutex_unlock(&job_mutex);
+			break;
+		}
+		generation = job.generation;
+		pthread_mutex_unlock(&job_mutex);
+
+		run_tasks(worker);
+	}
+
+	return NULL;
+}
+
+static void init_worker(struct worker* worker) {
+	worker->cinfo.err = jpeg_std_error(&worker->jerr);
+	jpeg_create_decompress(&worker->cinfo);
+}
+
+/**
+ * threads - count of decoding threads, caller included.
+ * Frames having restart intervals are decoded in parallel if more than one.
+ */
+void mjpeg_init(int threads) {
+	if (threads < 1) {
+		threads = 1;
+	} else if (threads > MJPEG_MAX_THREADS) {
+		threads = MJPEG_MAX_THREADS;
+	}
+
+	init_worker(&workers[0]);
+
+	for (workers_count = 1; workers_count < threads; workers_count++) {
+		struct worker* worker = &workers[workers_count];
+
+		init_worker(worker);
+
+		if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+			jpeg_destroy_decompress(&worker->cinfo);
+			fprintf(stderr, "Can't create decoding thread, %d used\n", workers_count);
+			break;
+		}
+	}
+
+#	ifdef DEBUG
+	printf("Decoding threads: %d\n", workers_count);
+#	endif
+}
+
+void mjpeg_close(void) {
+	pthread_mutex_lock(&job_mutex);
+	job.stop = 1;
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_mutex);
+
+	for (int i = 0; i < workers_count; i++) {
+		if (i) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		jpeg_destroy_decompress(&workers[i].cinfo);
+		free(workers[i].buffer);
+		free(workers[i].row);
+		memset(&workers[i], 0, sizeof(workers[i]));
+	}
+
+	workers_count = 0;
+	job.stop = 0;
+}
+
+// Sets scale of frames decoded for metering: 1, 2, 4 or 8. Smaller output skips inverse DCT work.
+void mjpeg_set_scale(int denom) {
+	scale_denom = denom;
+}
+
+// Decodes frame to RGB pixels. Frame must fit output image.
+void mjpeg_decode(const unsigned char* data, unsigned long length, unsigned char* frame) {
+	struct jpeg_decompress_struct* cinfo = &workers[0].cinfo;
+	unsigned char* buffer_array[1];
+	int row_bytes;
+
+	jpeg_mem_src(cinfo, data, length);
+	jpeg_read_header(cinfo, 1);
+	cinfo->out_color_space = JCS_RGB;
+	jpeg_start_decompress(cinfo);
+
+	row_bytes = cinfo->output_width * cinfo->output_components;
+
+	while (cinfo->output_scanline < cinfo->output_height) {
+		// Pixels follow in the format RGB
+		buffer_array[0] = frame;
+		jpeg_read_scanlines(cinfo, buffer_array, 1);
+		frame += row_bytes;
+	}
+
+	jpeg_finish_decompress(cinfo);
+}
+
+/**
+ * Fills MJPEG_SIGNATURE_CELLS mean luma values of frame regions.
+ * Luma is decoded at 1/8 scale, what takes only DC coefficient of every block
+ * and skips chroma processing, inverse DCT and color conversion.
+ */
+void mjpeg_signature(const unsigned char* data, unsigned long length, unsigned int* signature) {
+	struct jpeg_decompress_struct* cinfo = &workers[0].cinfo;
+	unsigned long counts[MJPEG_SIGNATURE_CELLS] = {0};
+	unsigned long sums[MJPEG_SIGNATURE_CELLS] = {0};
+	unsigned char* buffer_array[1];
+
+	jpeg_mem_src(cinfo, data, length);
+	jpeg_read_header(cinfo, 1);
+	cinfo->out_color_space = JCS_GRAYSCALE;
+	cinfo->scale_num = 1;
+	cinfo->scale_denom = 8;
+	jpeg_start_decompress(cinfo);
+
+	workers[0].row = grow(workers[0].row, &workers[0].row_size, cinfo->output_width * cinfo->output_components);
+	buffer_array[0] = workers[0].row;
+
+	while (cinfo->output_scanline < cinfo->output_height) {
+		unsigned int cell_row = cinfo->output_scanline * MJPEG_SIGNATURE_GRID / cinfo->output_height;
+
+		jpeg_read_scanlines(cinfo, buffer_array, 1);
+
+		for (unsigned int x = 0; x < cinfo->output_width; x++) {
+			unsigned int cell = cell_row * MJPEG_SIGNATURE_GRID + x * MJPEG_SIGNATURE_GRID / cinfo->output_width;
+
+			sums[cell] += workers[0].row[x];
+			counts[cell]++;
+		}
+	}
+
+	jpeg_finish_decompress(cinfo);
+
+	for (int i = 0; i < MJPEG_SIGNATURE_CELLS; i++) {
+		signature[i] = counts[i] ? sums[i] / counts[i] : 0;
+	}
+}
+
+// Adapts sampling stride of frames without restart intervals to keep the confidence interval within tolerance.
+static void adapt_stride(const struct estimate* estimate, unsigned int bands) {
+	double tolerance = estimate_tolerance();
+	int sampled = (bands + sample_stride * 2 - 1) / (sample_stride * 2);
+	int min_parts = estimate_min_parts(bands);
+
+	if (estimate->parts >= min_parts && sample_stride < ESTIMATE_MAX_STRIDE &&
+		sampled >= min_parts && estimate_predict(estimate, sampled, bands) < tolerance) {
+		sample_stride *= 2;
+	} else if (sample_stride > 1 && (estimate->parts < min_parts ||
+		estimate_halfwidth(estimate, bands) >= tolerance)) {
+		sample_stride /= 2;
+	}
+}
+
+/**
+ * Returns sum of frame pixels brightness in LUMA_ONE fixed point, pixels receives metered pixels count.
+ * Frames with restart intervals are cut at MCU row aligned restart markers and decoded on all threads,
+ * others are decoded by the calling thread.
+ * While estimating (see estimate_init()) parts are decoded in stratified order until the confidence
+ * interval of the mean is narrow enough. Frames decoded by one thread meter every sample_stride band,
+ * stride is adapted from frame to frame.
+ */
+unsigned long long mjpeg_luma(const unsigned char* data, unsigned long length, unsigned long long* pixels) {
+	struct layout layout;
+	int tasks_count = 0;
+	unsigned long long sum;
+
+	if (workers_count > 1 && parse_headers(data, length, &layout) == 0) {
+		tasks_count = split_tasks(data, length, &layout, job.tasks);
+	}
+
+	if (!tasks_count) {
+		struct estimate estimate;
+		unsigned int stride = estimate_tolerance() > 0 ? sample_stride : 1;
+
+		estimate_reset(&estimate);
+		sum = decode_luma(&workers[0], data, length, pixels, stride, sample_phase++, &estimate);
+
+		estimate_account(*pixels / workers[0].cinfo.output_width, workers[0].cinfo.output_height);
+
+		if (estimate_tolerance() > 0) {
+			adapt_stride(&estimate, workers[0].cinfo.total_iMCU_rows);
+		}
+
+		return sum;
+	}
+
+	pthread_mutex_lock(&job_mutex);
+	job.data = data;
+	job.layout = &layout;
+	job.tasks_count = tasks_count;
+	job.order_bits = estimate_bits(tasks_count);
+	job.next_step = 0;
+	job.started_tasks = 0;
+	job.done_tasks = 0;
+	job.converged = 0;
+	job.touched_rows = 0;
+	estimate_reset(&job.estimate);
+	job.generation++;
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_mutex);
+
+	run_tasks(&workers[0]);
+
+	pthread_mutex_lock(&job_mutex);
+	while (job.done_tasks < job.started_tasks) {
+		pthread_cond_wait(&done_cond, &job_mutex);
+	}
+	sum = job.estimate.sum;
+	*pixels = job.estimate.pixels;
+	estimate_account(job.touched_rows, layout.height);
+	pthread_mutex_unlock(&job_mutex);
+
+	return sum;
+}
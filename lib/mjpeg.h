@@ -0,0 +1,22 @@
+// MJPEG frames decoding.
+
+#ifndef MJPEG_H
+#define MJPEG_H
+
+// Upper bound of independently decoded parts of one frame.
+#define MJPEG_MAX_TASKS 64
+#define MJPEG_MAX_THREADS 32
+// Scanlines requested from decoder at once, covers the tallest MCU.
+#define MJPEG_BATCH_ROWS 16
+// Frame signature is a grid of mean luma values.
+#define MJPEG_SIGNATURE_GRID 4
+#define MJPEG_SIGNATURE_CELLS (MJPEG_SIGNATURE_GRID * MJPEG_SIGNATURE_GRID)
+
+void mjpeg_init(int);
+void mjpeg_close(void);
+void mjpeg_set_scale(int);
+void mjpeg_decode(const unsigned char*, unsigned long, unsigned char*);
+void mjpeg_signature(const unsigned char*, unsigned long, unsigned int*);
+unsigned long long mjpeg_luma(const unsigned char*, unsigned long, unsigned long long*);
+
+#endif
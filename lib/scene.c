@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+#include "mjpeg.h"
+
+// Signature of the last fully metered frame.
+static struct {
+	unsigned long length;
+	unsigned int signature[SCENE_RAW_SAMPLES];
+	int signature_valid;
+	// Copy of the last metered MJPEG frame, its signature is computed only once a frame is compared with it.
+	unsigned char* data;
+	unsigned long data_size;
+	int data_valid;
+} reference;
+
+// Allowed signature difference in 8 bit levels, 0 disables detection.
+static double tolerance = 0;
+static int reuses = 0;
+static unsigned long frames = 0;
+static unsigned long reused = 0;
+
+/**
+ * tolerance - scene is unchanged while every signature cell differs
+ * from the last metered frame less than tolerance percents of full scale.
+ */
+void scene_init(double percents) {
+	scene_close();
+	tolerance = percents * 255 / 100;
+	reuses = 0;
+}
+
+void scene_close(void) {
+	free(reference.data);
+	memset(&reference, 0, sizeof(reference));
+}
+
+static int compare(const unsigned int* signature, int count) {
+	for (int i = 0; i < count; i++) {
+		double delta = (double)signature[i] - reference.signature[i];
+
+		if (delta > tolerance || -delta > tolerance) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Accounts decision. Reference is kept at the last metered frame, so slow drifts can't accumulate.
+static int decide(int unchanged, const unsigned int* signature, int count, unsigned long length) {
+	if (unchanged) {
+		reuses++;
+		reused++;
+		return 1;
+	}
+
+	reuses = 0;
+	reference.length = length;
+	reference.data_valid = 0;
+	reference.signature_valid = signature != NULL;
+	if (signature != NULL) {
+		memcpy(reference.signature, signature, count * sizeof(*signature));
+	}
+
+	return 0;
+}
+
+// Keeps a copy of the frame metered without its signature, copying is far cheaper than decoding.
+static void keep_frame(const unsigned char* data, unsigned long length) {
+	if (length > reference.data_size) {
+		unsigned char* grown = realloc(reference.data, length);
+
+		if (NULL == grown) {
+			return;
+		}
+
+		reference.data = grown;
+		reference.data_size = length;
+	}
+
+	memcpy(reference.data, data, length);
+	reference.data_valid = 1;
+}
+
+/**
+ * Returns 1 if MJPEG frame shows the same scene as the last metered one, 0 if it must be metered.
+ * Compressed size is compared first, DC signature (luma decoded at 1/8 scale) is computed only
+ * when size is close to the reference one. Frames metered without their signature are copied,
+ * the reference signature is decoded from the copy once a frame is compared with it.
+ */
+int scene_unchanged_mjpeg(const unsigned char* data, unsigned long length) {
+	unsigned int signature[MJPEG_SIGNATURE_CELLS];
+	double size_delta;
+
+	frames++;
+
+	if (tolerance <= 0) {
+		return 0;
+	}
+
+	size_delta = (double)length - reference.length;
+	if (!reference.length || (!reference.signature_valid && !reference.data_valid) || reuses >= SCENE_MAX_REUSE ||
+		size_delta > reference.length * SCENE_SIZE_TOLERANCE || -size_delta > reference.length * SCENE_SIZE_TOLERANCE) {
+		decide(0, NULL, 0, length);
+		keep_frame(data, length);
+		return 0;
+	}
+
+	if (!reference.signature_valid) {
+		mjpeg_signature(reference.data, reference.length, reference.signature);
+		reference.signature_valid = 1;
+		reference.data_valid = 0;
+	}
+
+	mjpeg_signature(data, length, signature);
+
+	return decide(compare(signature, MJPEG_SIGNATURE_CELLS), signature, MJPEG_SIGNATURE_CELLS, length);
+}
+
+/**
+ * The same for uncompressed frames of rows of row_bytes image bytes, stride bytes apart.
+ * Probes SCENE_RAW_SAMPLES short runs spread over the image, averaging bytes at even offsets,
+ * which are luma samples of packed YUV formats. Line padding is never probed.
+ */
+int scene_unchanged_raw(const unsigned char* data, unsigned int row_bytes, unsigned int stride, unsigned int rows) {
+	unsigned int signature[SCENE_RAW_SAMPLES];
+	unsigned long length = (unsigned long)row_bytes * rows;
+	unsigned long step = length / SCENE_RAW_SAMPLES;
+
+	frames++;
+
+	if (tolerance <= 0 || step < SCENE_RAW_RUN * 2 || row_bytes < SCENE_RAW_RUN * 2) {
+		return 0;
+	}
+
+	for (int i = 0; i < SCENE_RAW_SAMPLES; i++) {
+		unsigned long offset = (i * step + step / 2 - SCENE_RAW_RUN) & ~1UL;
+		unsigned long column = offset % row_bytes;
+		const unsigned char* run;
+
+		// Runs don't wrap to the next row.
+		if (column > row_bytes - SCENE_RAW_RUN * 2) {
+			column = (row_bytes - SCENE_RAW_RUN * 2) & ~1UL;
+		}
+		run = data + offset / row_bytes * stride + column;
+
+		signature[i] = 0;
+		for (int j = 0; j < SCENE_RAW_RUN; j++) {
+			signature[i] += run[j * 2];
+		}
+		signature[i] /= SCENE_RAW_RUN;
+	}
+
+	return decide(reference.signature_valid && reference.length == length && reuses < SCENE_MAX_REUSE &&
+		compare(signature, SCENE_RAW_SAMPLES), signature, SCENE_RAW_SAMPLES, length);
+}
+
+void scene_stats(unsigned long* frames_count, unsigned long* reused_count) {
+	*frames_count = frames;
+	*reused_count = reused;
+}
@@ -0,0 +1,22 @@
+// Cheap scene change detection in front of frame metering.
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#define SCENE_DEFAULT_TOLERANCE 1.0
+// Relative compressed size change treated as a new scene without further checks.
+#define SCENE_SIZE_TOLERANCE 0.05
+// Probed samples of uncompressed frames.
+#define SCENE_RAW_SAMPLES 64
+// Luma samples averaged by every probe, single pixels are too noisy.
+#define SCENE_RAW_RUN 8
+// Full metering is forced after this count of reused results in a row.
+#define SCENE_MAX_REUSE 30
+
+void scene_init(double);
+void scene_close(void);
+int scene_unchanged_mjpeg(const unsigned char*, unsigned long);
+int scene_unchanged_raw(const unsigned char*, unsigned int, unsigned int, unsigned int);
+void scene_stats(unsigned long*, unsigned long*);
+
+#endif
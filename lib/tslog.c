@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tslog.h"
+
+static struct tslog_header* header = NULL;
+static struct tslog_record* records;
+static size_t mapped_size;
+
+/**
+ * Maps ring log file of capacity records, created if missing. History of a file having
+ * the same layout is continued, other files are reinitialized. Exits on failure.
+ */
+void tslog_open(const char* path, uint32_t capacity) {
+	struct stat st;
+	int fd;
+
+	mapped_size = sizeof(struct tslog_header) + (size_t)capacity * sizeof(struct tslog_record);
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (-1 == fd || -1 == fstat(fd, &st)) {
+		fprintf(stderr, "Can't open log '%s': %d, %s\n", path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (st.st_size != mapped_size && -1 == ftruncate(fd, mapped_size)) {
+		fprintf(stderr, "Can't resize log '%s': %d, %s\n", path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	header = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (MAP_FAILED == header) {
+		fprintf(stderr, "Can't map log '%s': %d, %s\n", path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	records = (struct tslog_record*)(header + 1);
+
+	if (st.st_size != mapped_size || memcmp(header->magic, TSLOG_MAGIC, TSLOG_MAGIC_LEN) != 0 ||
+		header->record_size != sizeof(struct tslog_record) || header->capacity != capacity) {
+		memset(header, 0, mapped_size);
+		header->record_size = sizeof(struct tslog_record);
+		header->capacity = capacity;
+		// Magic goes last, readers ignore the file until it is complete.
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(header->magic, TSLOG_MAGIC, TSLOG_MAGIC_LEN);
+	} else if (header->sequence & 1) {
+		// Previous writer died in the middle of a record.
+		header->sequence++;
+	}
+
+#	ifdef DEBUG
+	printf("Log %s: %u records, %llu written before\n", path, capacity, (unsigned long long)header->count);
+#	endif
+}
+
+int tslog_enabled(void) {
+	return NULL != header;
+}
+
+// Appends record, plain stores to the shared mapping, no system calls.
+void tslog_write(const struct tslog_record* record) {
+	uint64_t sequence = header->sequence;
+
+	__atomic_store_n(&header->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	records[header->count % header->capacity] = *record;
+	__atomic_store_n(&header->count, header->count + 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&header->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void tslog_close(void) {
+	if (NULL == header) {
+		return;
+	}
+
+	munmap(header, mapped_size);
+	header = NULL;
+}
@@ -0,0 +1,53 @@
+// Ring log of samples in a memory mapped file.
+
+#ifndef TSLOG_H
+#define TSLOG_H
+
+#include <stdint.h>
+
+#define TSLOG_MAGIC "ALTSLOG1"
+#define TSLOG_MAGIC_LEN 8
+#define TSLOG_DEFAULT_RECORDS 65536
+// Measured brightness is stored in units of 1/TSLOG_BRIGHTNESS_SCALE of full scale.
+#define TSLOG_BRIGHTNESS_SCALE 10000
+// Record flags.
+#define TSLOG_FLAG_REUSED 1
+#define TSLOG_FLAG_POINT_CHANGED 2
+
+/**
+ * File starts with the header followed by capacity records. Record of sample n is at n % capacity.
+ * sequence is odd while a record is being written (seqlock): readers copy what they need and
+ * retry if sequence was odd or has changed meanwhile.
+ */
+struct tslog_header {
+	char magic[TSLOG_MAGIC_LEN];
+	uint32_t record_size;
+	uint32_t capacity;
+	uint64_t sequence;
+	// Records written since the file has been created.
+	uint64_t count;
+	uint8_t reserved[32];
+};
+
+struct tslog_record {
+	// CLOCK_REALTIME.
+	uint64_t timestamp_ns;
+	// Stage timings: frame dequeue and metering, backlight update of all outputs, whole sample.
+	uint32_t frame_us;
+	uint32_t backlight_us;
+	uint32_t sample_us;
+	uint16_t brightness;
+	// Applied backlight in percents, -1 if there was no output.
+	int8_t backlight;
+	// Governor operating point.
+	uint8_t point;
+	uint8_t flags;
+	uint8_t reserved[7];
+};
+
+void tslog_open(const char*, uint32_t);
+int tslog_enabled(void);
+void tslog_write(const struct tslog_record*);
+void tslog_close(void);
+
+#endif
@@ -3,17 +3,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
-#include <jpeglib.h>
 #include <fcntl.h>
 #include <linux/videodev2.h>
 #include "v4l2.h"
+#include "mjpeg.h"
+#include "scene.h"
+#include "luma.h"
+#include "cache.h"
+#include "estimate.h"
 
 int capture_width = DEFAULT_CAPTURE_WIDTH;
 int capture_height = DEFAULT_CAPTURE_HEIGHT;
+// Pick the cheapest capture mode instead of capture_width x capture_height MJPEG.
+int capture_auto = 1;
 
 static struct buffers* buffers;
 static int fd;
@@ -21,45 +30,138 @@ static int buffers_count;
 static char device_name[DEVICE_NAME_MAXLEN];
 static int auto_exposure_types[] = {V4L2_EXPOSURE_AUTO, V4L2_EXPOSURE_SHUTTER_PRIORITY, V4L2_EXPOSURE_APERTURE_PRIORITY};
 static unsigned int pixel_format = DEFAULT_PIXEL_FORMAT;
+// Distance between rows of uncompressed frames, drivers may pad rows.
+static unsigned int bytes_per_line = 0;
+// Device has been unplugged, it is only released.
+static int lost = 0;
+// Result of the last metered frame, reused while scene is unchanged.
+static unsigned long long last_sum = 0;
+static unsigned long long last_pixels = 0;
 
 static void errno_exit(const char *s) {
 	fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
 	exit(EXIT_FAILURE);
 }
 
-static void dqbuf(struct v4l2_buffer* buf) {
-	do {
-		if (-1 == ioctl(fd, VIDIOC_DQBUF, buf)) {
-			if (errno != EAGAIN) {
-				errno_exit("VIDIOC_DQBUF");
+// Errors meaning the camera has been unplugged.
+static int device_gone(int error) {
+	return ENODEV == error || EIO == error;
+}
+
+static int qbuf(struct v4l2_buffer* buf) {
+	if (-1 == ioctl(fd, VIDIOC_QBUF, buf)) {
+		if (device_gone(errno)) {
+			lost = 1;
+			return -1;
+		}
+		errno_exit("VIDIOC_QBUF");
+	}
+
+	return 0;
+}
+
+/**
+ * Waits for a frame, corrupted ones are queued back. Returns -1 and marks the device lost
+ * if it has been unplugged or sends no frame for FRAME_TIMEOUT_MS.
+ */
+static int dqbuf(struct v4l2_buffer* buf) {
+	struct pollfd pfd = {fd, POLLIN, 0};
+	int ready;
+
+	for (;;) {
+		if (0 == ioctl(fd, VIDIOC_DQBUF, buf)) {
+			if (!(buf->flags & V4L2_BUF_FLAG_ERROR)) {
+				return 0;
 			}
-		} else {
+			if (-1 == qbuf(buf)) {
+				return -1;
+			}
+			continue;
+		}
+
+		if (device_gone(errno)) {
 			break;
+		} else if (EAGAIN != errno) {
+			errno_exit("VIDIOC_DQBUF");
+		}
+
+		ready = poll(&pfd, 1, FRAME_TIMEOUT_MS);
+		if (-1 == ready && EINTR == errno) {
+			continue;
 		}
-	} while(errno == EAGAIN || (buf->flags & V4L2_BUF_FLAG_ERROR));
+		if (ready <= 0 || (pfd.revents & (POLLERR | POLLHUP))) {
+			break;
+		}
+	}
+
+	fprintf(stderr, "%s: no frames, device lost\n", device_name);
+	lost = 1;
+
+	return -1;
 }
 
-static void qbuf(struct v4l2_buffer* buf) {
-	if (-1 == ioctl(fd, VIDIOC_QBUF, buf)) {
-		errno_exit("VIDIOC_QBUF");
+// Returns /dev/v4l/by-id link resolving to the same device as name, or name itself if there is none.
+static void stable_name(const char* name, char* stable, size_t size) {
+	char device[PATH_MAX], link[PATH_MAX + 256], target[PATH_MAX];
+	struct dirent* entry;
+	DIR* dir;
+
+	snprintf(stable, size, "%s", name);
+
+	if (NULL == realpath(name, device) || NULL == (dir = opendir(STABLE_DEVICE_DIR))) {
+		return;
+	}
+
+	while (NULL != (entry = readdir(dir))) {
+		snprintf(link, sizeof(link), "%s/%s", STABLE_DEVICE_DIR, entry->d_name);
+
+		if (entry->d_name[0] != '.' && NULL != realpath(link, target) && strcmp(target, device) == 0 &&
+			strlen(link) < size) {
+			strcpy(stable, link);
+			break;
+		}
 	}
+
+	closedir(dir);
+}
+
+/**
+ * Returns 1 if the default device used last time still exists, its stable name is copied to name.
+ * Cache of the device in use stays active.
+ */
+static int last_device(char* name, struct stat* st) {
+	char cached[DEVICE_NAME_MAXLEN];
+
+	if (-1 == cache_peek(LAST_DEVICE_CACHE_ID, "device", cached, sizeof(cached)) ||
+		-1 == stat(cached, st) || !S_ISCHR(st->st_mode)) {
+		return 0;
+	}
+
+	strcpy(name, cached);
+
+	return 1;
 }
 
+/**
+ * Opens name or, if NULL, the device used last time or the first of /dev/video0-9.
+ * The default device is remembered by its stable /dev/v4l/by-id name.
+ */
 void open_device(char* name) {
+	char last[DEVICE_NAME_MAXLEN];
 	struct stat st;
     int def_name = 0;
     int stat_res;
 
     if (NULL == name) {
         def_name = 1;
-        name = malloc(DEFAULT_DEVICE_TMPLEN + 1);
+        name = malloc(DEVICE_NAME_MAXLEN);
 
         if (NULL == name) {
             fprintf(stderr, "Out of memory\n");
 			exit(EXIT_FAILURE);
         }
 
-        for (int i = 0; i < DEFAULT_DEVICE_MAXNUM; i++) {
+        for (int i = last_device(name, &st) ? DEFAULT_DEVICE_MAXNUM : 0; i < DEFAULT_DEVICE_MAXNUM; i++) {
             sprintf(name, DEFAULT_DEVICE_TMP, i);
 
 #           ifdef DEBUG
@@ -105,11 +207,82 @@ void open_device(char* name) {
     }
 
     if (def_name) {
+		stable_name(name, device_name, sizeof(device_name));
+
+		if (-1 == cache_peek(LAST_DEVICE_CACHE_ID, "device", last, sizeof(last)) || strcmp(last, device_name) != 0) {
+			cache_put(LAST_DEVICE_CACHE_ID, "device", device_name);
+		}
+
+#		ifdef DEBUG
+		printf("Default device %s\n", device_name);
+#		endif
+
         free(name);
     }
 }
 
-static void set_format(void) {
+/**
+ * Returns 1 if name (the default device if NULL, see open_device()) is a video capture device
+ * which can be opened now. The kernel announces devices before udev grants access to them.
+ */
+int device_available(char* name) {
+	char found[DEVICE_NAME_MAXLEN];
+	struct v4l2_capability capabilities;
+	struct stat st;
+	int probe, available;
+
+	if (NULL == name) {
+		name = found;
+
+		if (!last_device(found, &st)) {
+			int i;
+
+			for (i = 0; i < DEFAULT_DEVICE_MAXNUM; i++) {
+				sprintf(found, DEFAULT_DEVICE_TMP, i);
+				if (0 == stat(found, &st)) {
+					break;
+				}
+			}
+
+			if (i == DEFAULT_DEVICE_MAXNUM) {
+				return 0;
+			}
+		}
+	}
+
+	probe = open(name, O_RDWR | O_NONBLOCK, 0);
+	if (-1 == probe) {
+		return 0;
+	}
+
+	available = 0 == ioctl(probe, VIDIOC_QUERYCAP, &capabilities) &&
+		(capabilities.capabilities & V4L2_CAP_VIDEO_CAPTURE);
+	close(probe);
+
+	return available;
+}
+
+struct capture_mode {
+	unsigned int pixel_format;
+	unsigned int width;
+	unsigned int height;
+	struct v4l2_fract interval;
+};
+
+// Formats read_frame_luma() handles, with estimated costs (see `make bench`).
+static const struct {
+	unsigned int pixel_format;
+	double pixel_cost;
+	double pixel_bytes;
+} mode_formats[] = {
+	{V4L2_PIX_FMT_MJPEG, MODE_MJPEG_PIXEL_COST, MODE_MJPEG_PIXEL_BYTES},
+	{V4L2_PIX_FMT_YUYV, MODE_YUYV_PIXEL_COST, MODE_YUYV_PIXEL_BYTES}
+};
+
+#define MODE_FORMATS_COUNT ((int)(sizeof(mode_formats) / sizeof(*mode_formats)))
+
+// Returns -1 if driver rejects capture_width x capture_height pixel_format or substitutes another pixel format.
+static int try_format(void) {
 	struct v4l2_format format;
 
 	format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -118,25 +291,205 @@ static void set_format(void) {
 		errno_exit("VIDIOC_G_FMT");
 	}
 
-	// TODO: add various pixel formats
-
 	format.fmt.pix.width = capture_width;
 	format.fmt.pix.height = capture_height;
 	format.fmt.pix.pixelformat = pixel_format;
 	format.fmt.pix.field = V4L2_FIELD_NONE;
 
-	if (-1 == ioctl(fd, VIDIOC_S_FMT, &format)) {
-		fprintf(stderr, "Video cam don't support V4L2_PIX_FMT_MJPEG pixel format");
-		errno_exit("VIDIOC_S_FMT");
+	if (-1 == ioctl(fd, VIDIOC_S_FMT, &format) || format.fmt.pix.pixelformat != pixel_format) {
+		return -1;
 	}
 
 	capture_width = format.fmt.pix.width;
 	capture_height = format.fmt.pix.height;
+	bytes_per_line = format.fmt.pix.bytesperline ? format.fmt.pix.bytesperline : capture_width * MODE_YUYV_PIXEL_BYTES;
+
+	return 0;
+}
+
+static void set_format(void) {
+	if (-1 == try_format()) {
+		fprintf(stderr, "Video cam don't support %.4s pixel format\n", (char*)&pixel_format);
+		errno_exit("VIDIOC_S_FMT");
+	}
+}
+
+// Best effort, driver may not support frame interval setting.
+static void set_interval(struct v4l2_fract* interval) {
+	struct v4l2_streamparm parm;
+
+	if (!interval->numerator || !interval->denominator) {
+		return;
+	}
+
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (-1 == ioctl(fd, VIDIOC_G_PARM, &parm) || !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+		return;
+	}
+
+	parm.parm.capture.timeperframe = *interval;
+	ioctl(fd, VIDIOC_S_PARM, &parm);
+}
+
+// Estimated nanoseconds to meter one frame plus to stream one second.
+static double mode_cost(int format, unsigned int width, unsigned int height, struct v4l2_fract* interval) {
+	double pixels = (double)width * height;
+	double fps = interval->numerator ? (double)interval->denominator / interval->numerator : MODE_UNKNOWN_FPS;
+
+	return pixels * mode_formats[format].pixel_cost +
+		pixels * mode_formats[format].pixel_bytes * fps * MODE_TRANSFER_BYTE_COST;
+}
+
+// Longest frame interval of frame size, zero if driver doesn't enumerate intervals.
+static void slowest_interval(unsigned int format, unsigned int width, unsigned int height, struct v4l2_fract* slowest) {
+	struct v4l2_frmivalenum frmival;
+
+	memset(slowest, 0, sizeof(*slowest));
+	memset(&frmival, 0, sizeof(frmival));
+	frmival.pixel_format = format;
+	frmival.width = width;
+	frmival.height = height;
+
+	for (frmival.index = 0; 0 == ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival); frmival.index++) {
+		struct v4l2_fract* candidate = frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE ?
+			&frmival.discrete : &frmival.stepwise.max;
+
+		if (!slowest->denominator || (unsigned long long)candidate->numerator * slowest->denominator >
+			(unsigned long long)slowest->numerator * candidate->denominator) {
+			*slowest = *candidate;
+		}
+
+		if (frmival.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+			break;
+		}
+	}
+}
+
+// Walks formats, frame sizes and intervals. Returns 0 if the cheapest mode is found, -1 otherwise.
+static int enum_modes(struct capture_mode* best) {
+	struct v4l2_fmtdesc fmtdesc;
+	double best_cost = -1;
+
+	memset(&fmtdesc, 0, sizeof(fmtdesc));
+	fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	for (fmtdesc.index = 0; 0 == ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc); fmtdesc.index++) {
+		struct v4l2_frmsizeenum frmsize;
+		int format = -1;
+
+		for (int i = 0; i < MODE_FORMATS_COUNT; i++) {
+			if (mode_formats[i].pixel_format == fmtdesc.pixelformat) {
+				format = i;
+			}
+		}
+
+		if (format == -1) {
+			continue;
+		}
+
+		memset(&frmsize, 0, sizeof(frmsize));
+		frmsize.pixel_format = fmtdesc.pixelformat;
+
+		for (frmsize.index = 0; 0 == ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize); frmsize.index++) {
+			int discrete = frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE;
+			unsigned int width = discrete ? frmsize.discrete.width : frmsize.stepwise.min_width;
+			unsigned int height = discrete ? frmsize.discrete.height : frmsize.stepwise.min_height;
+			struct v4l2_fract interval;
+			double cost;
+
+			slowest_interval(fmtdesc.pixelformat, width, height, &interval);
+			cost = mode_cost(format, width, height, &interval);
+
+#			ifdef DEBUG
+			printf("Mode %.4s %ux%u %u/%us: cost %.0f\n", (char*)&fmtdesc.pixelformat, width, height,
+				interval.numerator, interval.denominator, cost);
+#			endif
+
+			if (best_cost < 0 || cost < best_cost) {
+				best_cost = cost;
+				best->pixel_format = fmtdesc.pixelformat;
+				best->width = width;
+				best->height = height;
+				best->interval = interval;
+			}
+
+			if (!discrete) {
+				break;
+			}
+		}
+	}
+
+	return best_cost < 0 ? -1 : 0;
+}
+
+static int apply_mode(struct capture_mode* mode) {
+	pixel_format = mode->pixel_format;
+	capture_width = mode->width;
+	capture_height = mode->height;
+
+	if (-1 == try_format()) {
+		return -1;
+	}
+
+	set_interval(&mode->interval);
+
+	return 0;
+}
+
+/**
+ * Negotiates capture mode. Unless size is requested explicitly the cheapest mode is used,
+ * it is enumerated once and cached per device (card and bus).
+ */
+static void choose_mode(void) {
+	struct capture_mode mode;
+
+	if (!capture_auto) {
+		set_format();
+		return;
+	}
+
+	mode.pixel_format = cache_get_long("pixel_format", 0);
+	mode.width = cache_get_long("width", 0);
+	mode.height = cache_get_long("height", 0);
+	mode.interval.numerator = cache_get_long("interval_numerator", 0);
+	mode.interval.denominator = cache_get_long("interval_denominator", 0);
+
+	if (mode.pixel_format && mode.width && mode.height && 0 == apply_mode(&mode) &&
+		capture_width == mode.width && capture_height == mode.height) {
+#		ifdef DEBUG
+		printf("Cached mode %.4s %ux%u\n", (char*)&pixel_format, capture_width, capture_height);
+#		endif
+		return;
+	}
+
+	if (-1 == enum_modes(&mode) || -1 == apply_mode(&mode)) {
+		// Driver enumerates nothing usable, requesting defaults.
+		pixel_format = DEFAULT_PIXEL_FORMAT;
+		capture_width = DEFAULT_CAPTURE_WIDTH;
+		capture_height = DEFAULT_CAPTURE_HEIGHT;
+		set_format();
+		return;
+	}
+
+#	ifdef DEBUG
+	printf("Chosen mode %.4s %ux%u %u/%us\n", (char*)&pixel_format, capture_width, capture_height,
+		mode.interval.numerator, mode.interval.denominator);
+#	endif
+
+	cache_set_long("pixel_format", pixel_format);
+	cache_set_long("width", capture_width);
+	cache_set_long("height", capture_height);
+	cache_set_long("interval_numerator", mode.interval.numerator);
+	cache_set_long("interval_denominator", mode.interval.denominator);
+	cache_save();
 }
 
 int init_device(void) {
     int auto_exposure = 0;
 	struct v4l2_capability capabilities;
+	char id[sizeof(capabilities.card) + sizeof(capabilities.bus_info) + 2];
 	struct v4l2_queryctrl queryctrl;
 	struct v4l2_cropcap cropcap;
 	struct v4l2_crop crop;
@@ -161,7 +514,11 @@ int init_device(void) {
 		exit(EXIT_FAILURE);
 	}
 
-	set_format();
+	// Device state kept between runs: capture mode, exposure, gain and the last brightness.
+	snprintf(id, sizeof(id), "%s-%s", (char*)capabilities.card, (char*)capabilities.bus_info);
+	cache_load(id);
+
+	choose_mode();
 
 	memset(&cropcap, 0, sizeof(cropcap));
 	cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -215,13 +572,84 @@ int init_device(void) {
     return auto_exposure;
 }
 
-void close_device(void) {
+/**
+ * Seeds exposure and gain with values saved by save_controls() last run, so auto exposure
+ * starts near convergence. Exposure is only writable in manual mode, auto mode is switched back after.
+ * Many drivers take exposure over again in auto mode, so it is read back: returns 1 only if
+ * the restored exposure is still in effect, a shorter calibration is safe only then.
+ */
+int restore_controls(void) {
+	long exposure = cache_get_long("exposure_absolute", -1);
+	long gain = cache_get_long("gain", -1);
+	struct v4l2_control ctrl, auto_ctrl;
+	int restored = 0;
+
+	if (exposure == -1 && gain == -1) {
+		return 0;
+	}
+
+	auto_ctrl.id = V4L2_CID_EXPOSURE_AUTO;
+	if (-1 == ioctl(fd, VIDIOC_G_CTRL, &auto_ctrl)) {
+		auto_ctrl.value = V4L2_EXPOSURE_MANUAL;
+	}
+
+	if (exposure != -1) {
+		ctrl.id = V4L2_CID_EXPOSURE_AUTO;
+		ctrl.value = V4L2_EXPOSURE_MANUAL;
+		ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+
+		ctrl.id = V4L2_CID_EXPOSURE_ABSOLUTE;
+		ctrl.value = exposure;
+		restored = 0 == ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+
+		if (auto_ctrl.value != V4L2_EXPOSURE_MANUAL) {
+			ioctl(fd, VIDIOC_S_CTRL, &auto_ctrl);
+		}
+
+		ctrl.id = V4L2_CID_EXPOSURE_ABSOLUTE;
+		restored = restored && 0 == ioctl(fd, VIDIOC_G_CTRL, &ctrl) && ctrl.value == exposure;
+	}
+
+	// Gain alone doesn't make calibration shorter.
+	if (gain != -1) {
+		ctrl.id = V4L2_CID_GAIN;
+		ctrl.value = gain;
+		ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+	}
+
+#	ifdef DEBUG
+	printf("Restored exposure %ld, gain %ld: %s\n", exposure, gain, restored ? "yes" : "no");
+#	endif
+
+	return restored;
+}
+
+// Saves current exposure and gain along with other cached device state.
+void save_controls(void) {
+	struct v4l2_control ctrl;
+
+	ctrl.id = V4L2_CID_EXPOSURE_ABSOLUTE;
+	if (0 == ioctl(fd, VIDIOC_G_CTRL, &ctrl)) {
+		cache_set_long("exposure_absolute", ctrl.value);
+	}
+
+	ctrl.id = V4L2_CID_GAIN;
+	if (0 == ioctl(fd, VIDIOC_G_CTRL, &ctrl)) {
+		cache_set_long("gain", ctrl.value);
+	}
+
+	cache_save();
+}
+
+static void stop_capturing(void) {
 	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-	if (-1 == ioctl(fd, VIDIOC_STREAMOFF, &type)) {
+	if (-1 == ioctl(fd, VIDIOC_STREAMOFF, &type) && !lost) {
 		errno_exit("VIDIOC_STREAMOFF");
 	}
+}
 
+static void uninit_mmap(void) {
 	for (int i = 0; i < buffers_count; i++) {
 		if (-1 == munmap(buffers[i].start, buffers[i].length)) {
 			errno_exit("munmap");
@@ -229,10 +657,19 @@ void close_device(void) {
 	}
 
 	free(buffers);
+	buffers = NULL;
+	buffers_count = 0;
+}
+
+void close_device(void) {
+	stop_capturing();
+	uninit_mmap();
 
-	if (-1 == close(fd)) {
+	if (-1 == close(fd) && !lost) {
 		errno_exit("close");
 	}
+
+	lost = 0;
 }
 
 void init_mmap(void) {
@@ -288,78 +725,167 @@ void init_mmap(void) {
 	}
 }
 
-void read_frame(unsigned char* frame) {
-	struct v4l2_buffer buf;
+static void verify_frame(struct v4l2_buffer* buf) {
 #	ifdef DEBUG
 	static int verified = 0;
 	FILE* verification_img;
+
+	if (!verified) {
+		verification_img = fopen("test.jpg", "wb");
+		if (NULL == verification_img) {
+			errno_exit("fopen");
+		}
+		if (1 != fwrite(buffers[buf->index].start, buf->bytesused, 1, verification_img)) {
+			fprintf(stderr, "Can't write verifying image\n");
+		}
+		if (EOF == fclose(verification_img)) {
+			errno_exit("fclose");
+		}
+		verified = 1;
+	}
 #	endif
+}
+
+// Returns -1 if the device is lost, see dqbuf().
+int read_frame(unsigned char* frame) {
+	struct v4l2_buffer buf;
 
 	memset(&buf, 0, sizeof(struct v4l2_buffer));
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	buf.memory = V4L2_MEMORY_MMAP;
 
-	dqbuf(&buf);
+	if (-1 == dqbuf(&buf)) {
+		return -1;
+	}
 	assert(buf.index < buffers_count);
 
 	switch (pixel_format) {
-		// TODO: add more pixel formats
 		case V4L2_PIX_FMT_MJPEG: {
-			int row_bytes, width, height, pixel_size;
-			unsigned char* buffer_array[1];
-			// Variables for the jpeg decompressor itself
-			struct jpeg_decompress_struct cinfo;
-			struct jpeg_error_mgr jerr;
-
-#			ifdef DEBUG
-			if (!verified) {
-				verification_img = fopen("test.jpg", "wb");
-				if (NULL == verification_img) {
-					errno_exit("fopen");
-				}
-				if (1 != fwrite(buffers[buf.index].start, buf.bytesused, 1, verification_img)) {
-					fprintf(stderr, "Can't write verifying image\n");
-				}
-				if (EOF == fclose(verification_img)) {
-					errno_exit("fclose");
-				}
-				verified = 1;
+			verify_frame(&buf);
+			mjpeg_decode(buffers[buf.index].start, buf.bytesused, frame);
+			break;
+		}
+		case V4L2_PIX_FMT_YUYV: {
+			for (int row = 0; row < capture_height; row++) {
+				luma_yuyv_to_rgb((unsigned char*)buffers[buf.index].start + row * bytes_per_line,
+					frame + row * capture_width * 3, capture_width);
 			}
-#			endif
+			break;
+		}
+	}
 
-			cinfo.err = jpeg_std_error(&jerr);
-			jpeg_create_decompress(&cinfo);
-			jpeg_mem_src(&cinfo, buffers[buf.index].start, buf.bytesused);
+	return qbuf(&buf);
+}
 
-			jpeg_read_header(&cinfo, 1);
-			jpeg_start_decompress(&cinfo);
+/**
+ * Returns sum of YUYV frame pixels brightness. While estimating (see estimate_init()) rows are
+ * metered in stratified order until the confidence interval of the mean is narrow enough.
+ */
+static unsigned long long yuyv_luma(const unsigned char* frame, unsigned long long* pixels) {
+	struct estimate estimate;
+	unsigned int bits = estimate_bits(capture_height);
+	unsigned int rows = 0;
 
-			width = cinfo.output_width;
-			height = cinfo.output_height;
-			pixel_size = cinfo.output_components;
-			row_bytes = width * pixel_size;
+	if (estimate_tolerance() <= 0) {
+		unsigned long long sum = 0;
 
-			buffer_array[0] = (unsigned char*)malloc(row_bytes);
+		for (int row = 0; row < capture_height; row++) {
+			sum += luma_yuyv_sum(frame + row * bytes_per_line, capture_width);
+		}
 
-			if (NULL == buffer_array[0]) {
-				fprintf(stderr, "Out of memory\n");
-				exit(EXIT_FAILURE);
-			}
+		*pixels = (unsigned long long)capture_width * capture_height;
+		estimate_account(capture_height, capture_height);
+		return sum;
+	}
 
-			while (cinfo.output_scanline < height) {
-				jpeg_read_scanlines(&cinfo, buffer_array, 1);
-				// Pixels follow in the format RGB
-				memcpy(frame, buffer_array[0], row_bytes);
-				frame += row_bytes;
-			}
+	estimate_reset(&estimate);
+
+	for (unsigned int step = 0; step < (1U << bits) && !estimate_converged(&estimate, capture_height); step++) {
+		unsigned int row = estimate_reverse(step, bits);
+
+		if (row >= capture_height) {
+			continue;
+		}
+
+		estimate_add(&estimate, luma_yuyv_sum(frame + row * bytes_per_line, capture_width), capture_width);
+		rows++;
+	}
+
+	*pixels = estimate.pixels;
+	estimate_account(rows, capture_height);
 
-			free(buffer_array[0]);
-			jpeg_finish_decompress(&cinfo);
-			jpeg_destroy_decompress(&cinfo);
+	return estimate.sum;
+}
+
+/**
+ * Reads frame, sum receives sum of its pixels brightness (see luma.h), pixels receives pixels count.
+ * Result of the previous frame is returned if scene hasn't changed since it.
+ * Returns -1 if the device is lost, see dqbuf().
+ */
+int read_frame_luma(unsigned long long* sum, unsigned long long* pixels) {
+	struct v4l2_buffer buf;
+
+	memset(&buf, 0, sizeof(struct v4l2_buffer));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+
+	*sum = 0;
+	*pixels = 0;
+
+	if (-1 == dqbuf(&buf)) {
+		return -1;
+	}
+	assert(buf.index < buffers_count);
+
+	switch (pixel_format) {
+		case V4L2_PIX_FMT_MJPEG: {
+			verify_frame(&buf);
+			if (scene_unchanged_mjpeg(buffers[buf.index].start, buf.bytesused)) {
+				*sum = last_sum;
+				*pixels = last_pixels;
+			} else {
+				*sum = last_sum = mjpeg_luma(buffers[buf.index].start, buf.bytesused, pixels);
+				last_pixels = *pixels;
+			}
 			break;
 		}
+		case V4L2_PIX_FMT_YUYV: {
+			if (scene_unchanged_raw(buffers[buf.index].start, capture_width * MODE_YUYV_PIXEL_BYTES,
+				bytes_per_line, capture_height)) {
+				*sum = last_sum;
+				*pixels = last_pixels;
+			} else {
+				*sum = last_sum = yuyv_luma(buffers[buf.index].start, pixels);
+				last_pixels = *pixels;
+			}
+			break;
+		}
+	}
+
+	return qbuf(&buf);
+}
+
+// Renegotiates capture size while streaming, capture_width and capture_height receive the new size.
+void set_capture_size(int width, int height) {
+	struct v4l2_requestbuffers reqbuf;
+
+	stop_capturing();
+	uninit_mmap();
+
+	// Driver keeps the format while any buffer is allocated.
+	memset(&reqbuf, 0, sizeof(reqbuf));
+	reqbuf.memory = V4L2_MEMORY_MMAP;
+	reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (-1 == ioctl(fd, VIDIOC_REQBUFS, &reqbuf)) {
+		errno_exit("VIDIOC_REQBUFS");
 	}
-	qbuf(&buf);
+
+	capture_width = width;
+	capture_height = height;
+	set_format();
+
+	init_mmap();
+	start_capturing();
 }
 
 void start_capturing(void) {
@@ -370,7 +896,9 @@ void start_capturing(void) {
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	buf.memory = V4L2_MEMORY_MMAP;
 
-	qbuf(&buf);
+	if (-1 == qbuf(&buf)) {
+		errno_exit("VIDIOC_QBUF");
+	}
 
 	if (-1 == ioctl(fd, VIDIOC_STREAMON, &type)) {
 		errno_exit("VIDIOC_STREAMON");
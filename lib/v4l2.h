@@ -7,8 +7,22 @@
 #define DEFAULT_DEVICE_TMP "/dev/video%d"
 #define DEFAULT_DEVICE_TMPLEN 11
 #define DEFAULT_DEVICE_MAXNUM 10
-#define DEVICE_NAME_MAXLEN 64
+// Fits /dev/v4l/by-id names.
+#define DEVICE_NAME_MAXLEN 256
+#define STABLE_DEVICE_DIR "/dev/v4l/by-id"
+// Cache file remembering the default device.
+#define LAST_DEVICE_CACHE_ID "default-device"
 #define DEFAULT_PIXEL_FORMAT V4L2_PIX_FMT_MJPEG
+// Device sending no frame for this long is considered lost.
+#define FRAME_TIMEOUT_MS 3000
+// Capture mode cost estimation: nanoseconds to meter a pixel, bytes per transferred pixel,
+// nanoseconds to stream a byte and frame rate assumed when driver doesn't tell it.
+#define MODE_MJPEG_PIXEL_COST 4.0
+#define MODE_MJPEG_PIXEL_BYTES 0.3
+#define MODE_YUYV_PIXEL_COST 2.0
+#define MODE_YUYV_PIXEL_BYTES 2.0
+#define MODE_TRANSFER_BYTE_COST 0.1
+#define MODE_UNKNOWN_FPS 30
 
 struct buffers {
 	void* start;
@@ -17,9 +31,14 @@ struct buffers {
 
 void open_device(char*);
 int init_device(void);
+int restore_controls(void);
+void save_controls(void);
 void close_device(void);
 void init_mmap(void);
 void start_capturing(void);
-void read_frame(unsigned char*);
+void set_capture_size(int, int);
+int device_available(char*);
+int read_frame(unsigned char*);
+int read_frame_luma(unsigned long long*, unsigned long long*);
 
 #endif
\ No newline at end of file
@@ -7,120 +7,320 @@
 #include <xcb/randr.h>
 #include "xws.h"
 
-static xcb_atom_t backlight, backlight_new, backlight_legacy;
-static xcb_connection_t *conn;
+struct xws_output {
+    xcb_randr_output_t id;
+    xcb_atom_t backlight;
+    int32_t min, max;
+    // Last applied level, -1 if unknown.
+    long level;
+    // Property notifications of own changes not received yet.
+    int own_changes;
+};
+
+struct xws_display {
+    char name[XWS_DISPLAY_NAME_MAXLEN];
+    xcb_connection_t *conn;
+    // "Backlight" and legacy "BACKLIGHT" atoms.
+    xcb_atom_t backlight[2];
+    int resources_current;
+    // First RandR event code.
+    uint8_t event_base;
+    struct xws_output outputs[XWS_MAX_OUTPUTS];
+    int outputs_count;
+    // Outputs must be enumerated again before next update.
+    int stale;
+};
+
+static struct xws_display displays[XWS_MAX_DISPLAYS];
+static int displays_count = 0;
+
+static void print_error(struct xws_display *display, char *request, xcb_generic_error_t *error) {
+    int ec = error ? error->error_code : -1;
+
+    fprintf(stderr, "%s: %s returned error %d\n", display->name, request, ec);
+    free(error);
+}
 
-static long xws_backlight_get(xcb_randr_output_t output) {
+/**
+ * Finds outputs having integer backlight property with range. Every stage is pipelined:
+ * requests for all screens (outputs) are sent before the first reply is awaited.
+ */
+static void xws_refresh_outputs(struct xws_display *display) {
+    xcb_connection_t *conn = display->conn;
     xcb_generic_error_t *error;
-    xcb_randr_get_output_property_reply_t *prop_reply = NULL;
-    xcb_randr_get_output_property_cookie_t prop_cookie;
-    long value;
-    
-    backlight = backlight_new;
-    prop_cookie = xcb_randr_get_output_property(conn, output, backlight, XCB_ATOM_NONE, 0, 4, 0, 0);
-    prop_reply = xcb_randr_get_output_property_reply(conn, prop_cookie, &error);
-
-    if (error != NULL || prop_reply == NULL) {
-        backlight = backlight_legacy;
-
-        if (backlight != XCB_ATOM_NONE) {
-            prop_cookie = xcb_randr_get_output_property(conn, output, backlight, XCB_ATOM_NONE, 0, 4, 0, 0);
-            prop_reply = xcb_randr_get_output_property_reply(conn, prop_cookie, &error);
-            if (error != NULL || prop_reply == NULL) {
-                return -1;
+    xcb_screen_iterator_t iter;
+    xcb_randr_output_t candidates[XWS_MAX_OUTPUTS];
+    int candidates_count = 0;
+    union {
+        xcb_randr_get_screen_resources_cookie_t all;
+        xcb_randr_get_screen_resources_current_cookie_t current;
+    } resources_cookies[XWS_MAX_SCREENS];
+    int screens_count = 0;
+    xcb_randr_get_output_property_cookie_t prop_cookies[XWS_MAX_OUTPUTS][2];
+    xcb_randr_query_output_property_cookie_t query_cookies[XWS_MAX_OUTPUTS];
+    xcb_atom_t atoms[XWS_MAX_OUTPUTS];
+
+    display->outputs_count = 0;
+    display->stale = 0;
+
+    // Current resources don't make the server poll hardware for changes.
+    for (iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
+        iter.rem && screens_count < XWS_MAX_SCREENS; xcb_screen_next(&iter)) {
+        xcb_window_t root = iter.data->root;
+
+        if (display->resources_current) {
+            resources_cookies[screens_count++].current = xcb_randr_get_screen_resources_current(conn, root);
+        } else {
+            resources_cookies[screens_count++].all = xcb_randr_get_screen_resources(conn, root);
+        }
+    }
+
+    for (int s = 0; s < screens_count; s++) {
+        xcb_randr_output_t *outputs = NULL;
+        int num_outputs = 0;
+        void *reply;
+
+        if (display->resources_current) {
+            xcb_randr_get_screen_resources_current_reply_t *current;
+
+            current = xcb_randr_get_screen_resources_current_reply(conn, resources_cookies[s].current, &error);
+            reply = current;
+            if (error == NULL && current != NULL) {
+                outputs = xcb_randr_get_screen_resources_current_outputs(current);
+                num_outputs = current->num_outputs;
+            }
+        } else {
+            xcb_randr_get_screen_resources_reply_t *resources;
+
+            resources = xcb_randr_get_screen_resources_reply(conn, resources_cookies[s].all, &error);
+            reply = resources;
+            if (error == NULL && resources != NULL) {
+                outputs = xcb_randr_get_screen_resources_outputs(resources);
+                num_outputs = resources->num_outputs;
             }
         }
+
+        if (error != NULL || reply == NULL) {
+            // One bad screen doesn't prevent the others from being used.
+            print_error(display, "RANDR Get Screen Resources", error);
+            free(reply);
+            continue;
+        }
+
+        for (int o = 0; o < num_outputs && candidates_count < XWS_MAX_OUTPUTS; o++) {
+            candidates[candidates_count++] = outputs[o];
+        }
+
+        free(reply);
     }
 
-    if (prop_reply == NULL ||
-        prop_reply->type != XCB_ATOM_INTEGER ||
-        prop_reply->num_items != 1 ||
-        prop_reply->format != 32) {
-	    value = -1;
-    } else {
-	    value = *((int32_t *) xcb_randr_get_output_property_data(prop_reply));
+    for (int c = 0; c < candidates_count; c++) {
+        for (int a = 0; a < 2; a++) {
+            if (display->backlight[a] != XCB_ATOM_NONE) {
+                prop_cookies[c][a] = xcb_randr_get_output_property(conn, candidates[c], display->backlight[a],
+                    XCB_ATOM_NONE, 0, 4, 0, 0);
+            }
+        }
     }
 
-    free(prop_reply);
-    return value;
-}
+    for (int c = 0; c < candidates_count; c++) {
+        atoms[c] = XCB_ATOM_NONE;
 
-int xws_backlight_set(long value) {
-    xcb_screen_iterator_t iter;
-    xcb_generic_error_t *error;
-    int success = -1;
+        for (int a = 0; a < 2; a++) {
+            xcb_randr_get_output_property_reply_t *prop_reply;
+
+            if (display->backlight[a] == XCB_ATOM_NONE) {
+                continue;
+            }
 
-    iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
+            prop_reply = xcb_randr_get_output_property_reply(conn, prop_cookies[c][a], &error);
 
-    while (iter.rem) {
-        xcb_screen_t *screen = iter.data;
-        xcb_window_t root = screen->root;
-        xcb_randr_output_t *outputs;
+            if (error != NULL) {
+                free(error);
+            } else if (atoms[c] == XCB_ATOM_NONE && prop_reply != NULL &&
+                prop_reply->type == XCB_ATOM_INTEGER && prop_reply->num_items == 1 && prop_reply->format == 32) {
+                atoms[c] = display->backlight[a];
+            }
+
+            free(prop_reply);
+        }
 
-        xcb_randr_get_screen_resources_cookie_t resources_cookie;
-        xcb_randr_get_screen_resources_reply_t *resources_reply;
+        if (atoms[c] != XCB_ATOM_NONE) {
+            query_cookies[c] = xcb_randr_query_output_property(conn, candidates[c], atoms[c]);
+        }
+    }
 
-        resources_cookie = xcb_randr_get_screen_resources(conn, root);
-        resources_reply = xcb_randr_get_screen_resources_reply(conn, resources_cookie, &error);
+    for (int c = 0; c < candidates_count; c++) {
+        xcb_randr_query_output_property_reply_t *query_reply;
 
-        if (error != NULL || resources_reply == NULL) {
-            int ec = error ? error->error_code : -1;
-            fprintf(stderr, "RANDR Get Screen Resources returned error %d\n", ec);
+        if (atoms[c] == XCB_ATOM_NONE) {
             continue;
         }
 
-        outputs = xcb_randr_get_screen_resources_outputs(resources_reply);
+        query_reply = xcb_randr_query_output_property_reply(conn, query_cookies[c], &error);
+
+        if (error != NULL || query_reply == NULL) {
+            free(error);
+            free(query_reply);
+            continue;
+        }
 
-        for (int o = 0; o < resources_reply->num_outputs; o++) {
-            xcb_randr_output_t output = outputs[o];
-            double scaling_factor;
-            double new;
-            double min, max;
+        if (query_reply->range && xcb_randr_query_output_property_valid_values_length(query_reply) == 2) {
+            int32_t *values = xcb_randr_query_output_property_valid_values(query_reply);
+            struct xws_output *output = &display->outputs[display->outputs_count++];
 
-            if (xws_backlight_get(output) != -1) {
-                xcb_randr_query_output_property_cookie_t prop_cookie;
-                xcb_randr_query_output_property_reply_t *prop_reply;
+            output->id = candidates[c];
+            output->backlight = atoms[c];
+            output->min = values[0];
+            output->max = values[1];
+            output->level = -1;
+            output->own_changes = 0;
+        }
 
-                prop_cookie = xcb_randr_query_output_property(conn, output, backlight);
-                prop_reply = xcb_randr_query_output_property_reply(conn, prop_cookie, &error);
+        free(query_reply);
+    }
 
-                if (error != NULL || prop_reply == NULL) continue;
+#   ifdef DEBUG
+    printf("%s: %d backlight outputs of %d\n", display->name, display->outputs_count, candidates_count);
+#   endif
+}
 
-                if (prop_reply->range && xcb_randr_query_output_property_valid_values_length(prop_reply) == 2) {
-                    int32_t* values = xcb_randr_query_output_property_valid_values(prop_reply);
+/**
+ * Sets backlight of every output of every display, value in range from 0 to 100.
+ * Updates are sent to all outputs first and checked afterwards, so latency doesn't grow
+ * with outputs count. Failed outputs are skipped and outputs are enumerated again next time.
+ * Returns 1 if at least one output has the requested level, -1 otherwise.
+ */
+int xws_backlight_set(long value) {
+    xcb_void_cookie_t cookies[XWS_MAX_DISPLAYS][XWS_MAX_OUTPUTS];
+    long levels[XWS_MAX_DISPLAYS][XWS_MAX_OUTPUTS];
+    int success = -1;
 
-                    min = values[0];
-                    max = values[1];
+    for (int d = 0; d < displays_count; d++) {
+        struct xws_display *display = &displays[d];
 
-                    scaling_factor = (max - min) / 100;
-                    new = value * scaling_factor;
+        if (xcb_connection_has_error(display->conn)) {
+            continue;
+        }
 
-                    if (new > max) new = max;
-                    if (new < min) new = min;
+        if (display->stale) {
+            xws_refresh_outputs(display);
+        }
 
-                    value = (long)new;
+        for (int o = 0; o < display->outputs_count; o++) {
+            struct xws_output *output = &display->outputs[o];
+            long level = output->min + value * (output->max - output->min) / 100;
+            int32_t data;
 
-                    xcb_randr_change_output_property(conn, output, backlight, XCB_ATOM_INTEGER, 32,
-                        XCB_PROP_MODE_REPLACE, 1, (unsigned char*)&value);
-                    xcb_flush(conn);
+            if (level > output->max) level = output->max;
+            if (level < output->min) level = output->min;
 
-                    success = 1;
-                }
+            levels[d][o] = level;
 
-                free(prop_reply);
+            if (level == output->level) {
+                success = 1;
+                continue;
             }
+
+            data = level;
+            cookies[d][o] = xcb_randr_change_output_property_checked(display->conn, output->id, output->backlight,
+                XCB_ATOM_INTEGER, 32, XCB_PROP_MODE_REPLACE, 1, (unsigned char*)&data);
         }
 
-        free(resources_reply);
-        xcb_screen_next(&iter);
+        xcb_flush(display->conn);
     }
 
-    xcb_aux_sync(conn);
+    for (int d = 0; d < displays_count; d++) {
+        struct xws_display *display = &displays[d];
+
+        if (xcb_connection_has_error(display->conn)) {
+            continue;
+        }
+
+        for (int o = 0; o < display->outputs_count; o++) {
+            struct xws_output *output = &display->outputs[o];
+            xcb_generic_error_t *error;
+
+            if (levels[d][o] == output->level) {
+                continue;
+            }
+
+            error = xcb_request_check(display->conn, cookies[d][o]);
+
+            if (error != NULL) {
+                print_error(display, "RANDR Change Output Property", error);
+                display->stale = 1;
+                continue;
+            }
+
+            output->level = levels[d][o];
+            output->own_changes++;
+            success = 1;
+        }
+    }
 
     return success;
 }
 
-void xws_init(char* display_name) {
+/**
+ * Backlight changed by someone else (desktop slider, brightness keys) makes the applied level unknown,
+ * so the next update is written even if it matches. Notifications arrive in order of changes, so
+ * a change made after ours is never taken for ours.
+ */
+static void xws_property_changed(struct xws_display *display, xcb_randr_output_property_t *property) {
+    for (int o = 0; o < display->outputs_count; o++) {
+        struct xws_output *output = &display->outputs[o];
+
+        if (output->id != property->output || output->backlight != property->atom) {
+            continue;
+        }
+
+        if (output->own_changes > 0) {
+            output->own_changes--;
+        } else {
+            output->level = -1;
+        }
+    }
+}
+
+/**
+ * Handles queued RandR events without blocking: outputs of displays which have changed
+ * are enumerated again before the next update.
+ */
+void xws_poll_events(void) {
+    for (int d = 0; d < displays_count; d++) {
+        struct xws_display *display = &displays[d];
+        xcb_generic_event_t *event;
+
+        while ((event = xcb_poll_for_event(display->conn)) != NULL) {
+            uint8_t type = event->response_type & ~0x80;
+
+            if (type == display->event_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+                display->stale = 1;
+            } else if (type == display->event_base + XCB_RANDR_NOTIFY) {
+                xcb_randr_notify_event_t *notify = (xcb_randr_notify_event_t*)event;
+
+                if (notify->subCode == XCB_RANDR_NOTIFY_OUTPUT_PROPERTY) {
+                    xws_property_changed(display, &notify->u.op);
+                } else {
+                    display->stale = 1;
+                }
+            }
+
+            free(event);
+        }
+    }
+
+#   ifdef DEBUG
+    for (int d = 0; d < displays_count; d++) {
+        if (displays[d].stale) {
+            printf("%s: outputs changed\n", displays[d].name);
+        }
+    }
+#   endif
+}
+
+static int xws_init_display(struct xws_display *display, char *name) {
     int backlight_len = strlen("backlight");
     xcb_generic_error_t *error;
 
@@ -130,51 +330,107 @@ void xws_init(char* display_name) {
     xcb_intern_atom_cookie_t backlight_cookie[2];
     xcb_intern_atom_reply_t *backlight_reply;
 
-    conn = xcb_connect(display_name, NULL);
-    ver_cookie = xcb_randr_query_version(conn, 1, 2);
-    ver_reply = xcb_randr_query_version_reply(conn, ver_cookie, &error);
+    snprintf(display->name, sizeof(display->name), "%s", name != NULL ? name : "default display");
+
+    display->conn = xcb_connect(name, NULL);
+    if (xcb_connection_has_error(display->conn)) {
+        fprintf(stderr, "%s: can't connect\n", display->name);
+        xcb_disconnect(display->conn);
+        return -1;
+    }
+
+    ver_cookie = xcb_randr_query_version(display->conn, 1, 3);
+    backlight_cookie[0] = xcb_intern_atom(display->conn, 1, backlight_len, "Backlight");
+    backlight_cookie[1] = xcb_intern_atom(display->conn, 1, backlight_len, "BACKLIGHT");
+
+    ver_reply = xcb_randr_query_version_reply(display->conn, ver_cookie, &error);
 
     if (error != NULL || ver_reply == NULL) {
-		int ec = error ? error->error_code : -1;
-		fprintf (stderr, "RANDR Query Version returned error %d\n", ec);
-		exit(EXIT_FAILURE);
+        print_error(display, "RANDR Query Version", error);
+        xcb_disconnect(display->conn);
+        return -1;
     }
 
     if (ver_reply->major_version != 1 || ver_reply->minor_version < 2) {
-		fprintf (stderr, "RandR version %d.%d too old\n", ver_reply->major_version, ver_reply->minor_version);
-		exit(EXIT_FAILURE);
+        fprintf(stderr, "%s: RandR version %d.%d too old\n", display->name,
+            ver_reply->major_version, ver_reply->minor_version);
+        free(ver_reply);
+        xcb_disconnect(display->conn);
+        return -1;
     }
 
+    display->resources_current = ver_reply->minor_version >= 3;
     free(ver_reply);
 
-    backlight_cookie[0] = xcb_intern_atom(conn, 1, backlight_len, "Backlight");
-    backlight_cookie[1] = xcb_intern_atom(conn, 1, backlight_len, "BACKLIGHT");
-
-    backlight_reply = xcb_intern_atom_reply(conn, backlight_cookie[0], &error);
-    if (error != NULL || backlight_reply == NULL) {
-        int ec = error ? error->error_code : -1;
-        fprintf(stderr, "Intern Atom returned error %d\n", ec);
-        exit(EXIT_FAILURE);
+    // Outputs connected, disconnected or reconfigured (docking) make the display stale,
+    // backlight changed by other clients must be applied again.
+    display->event_base = xcb_get_extension_data(display->conn, &xcb_randr_id)->first_event;
+    for (xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(display->conn));
+        iter.rem; xcb_screen_next(&iter)) {
+        xcb_randr_select_input(display->conn, iter.data->root,
+            XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE |
+            XCB_RANDR_NOTIFY_MASK_OUTPUT_PROPERTY);
     }
 
-    backlight_new = backlight_reply->atom;
-    free(backlight_reply);
-
-    if (backlight_new == XCB_NONE) {
-        backlight_reply = xcb_intern_atom_reply(conn, backlight_cookie[1], &error);
+    for (int a = 0; a < 2; a++) {
+        backlight_reply = xcb_intern_atom_reply(display->conn, backlight_cookie[a], &error);
 
         if (error != NULL || backlight_reply == NULL) {
-            int ec = error ? error->error_code : -1;
-            fprintf(stderr, "Intern Atom returned error %d\n", ec);
-            exit(EXIT_FAILURE);
+            print_error(display, "Intern Atom", error);
+            xcb_disconnect(display->conn);
+            return -1;
         }
 
-        backlight_legacy = backlight_reply->atom;
+        display->backlight[a] = backlight_reply->atom;
         free(backlight_reply);
+    }
+
+    if (display->backlight[0] == XCB_NONE && display->backlight[1] == XCB_NONE) {
+        fprintf(stderr, "%s: no outputs have backlight property\n", display->name);
+        xcb_disconnect(display->conn);
+        return -1;
+    }
+
+    xws_refresh_outputs(display);
+
+    return 0;
+}
 
-        if (backlight_legacy == XCB_NONE) {
-            fprintf(stderr, "No outputs have backlight property\n");
-            exit(EXIT_FAILURE);
+/**
+ * display_names - comma separated list of X displays, NULL or empty for $DISPLAY.
+ * Displays which can't be used are reported and skipped, returns -1 if none is usable.
+ */
+int xws_init(char* display_names) {
+    char names[XWS_DISPLAY_NAME_MAXLEN * XWS_MAX_DISPLAYS];
+    char *name, *saveptr;
+
+    if (display_names == NULL || *display_names == 0) {
+        if (xws_init_display(&displays[0], NULL) == 0) {
+            displays_count = 1;
         }
+    } else {
+        snprintf(names, sizeof(names), "%s", display_names);
+
+        for (name = strtok_r(names, ",", &saveptr); name != NULL && displays_count < XWS_MAX_DISPLAYS;
+            name = strtok_r(NULL, ",", &saveptr)) {
+            if (xws_init_display(&displays[displays_count], name) == 0) {
+                displays_count++;
+            }
+        }
+    }
+
+    if (displays_count == 0) {
+        fprintf(stderr, "No usable display\n");
+        return -1;
     }
+
+    return 0;
+}
+
+void xws_close(void) {
+    for (int d = 0; d < displays_count; d++) {
+        xcb_disconnect(displays[d].conn);
+    }
+
+    displays_count = 0;
 }
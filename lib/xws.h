@@ -3,7 +3,14 @@
 #ifndef XWS_H
 #define XWS_H
 
+#define XWS_MAX_DISPLAYS 8
+#define XWS_MAX_SCREENS 8
+#define XWS_MAX_OUTPUTS 32
+#define XWS_DISPLAY_NAME_MAXLEN 64
+
 int xws_backlight_set(long);
-void xws_init(char*);
+int xws_init(char*);
+void xws_poll_events(void);
+void xws_close(void);
 
 #endif
\ No newline at end of file
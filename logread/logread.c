@@ -0,0 +1,223 @@
+// Reads the ring log written by `autolight --log=FILE` while it is being written.
+// Prints one JSON object per record, or a summary.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../lib/tslog.h"
+
+#define FOLLOW_INTERVAL_MS 1000
+#define RETRY_INTERVAL_US 1000
+
+static const struct tslog_header* header;
+static const struct tslog_record* records;
+
+static void sleep_ms(long ms) {
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+
+	while (-1 == nanosleep(&ts, &ts) && EINTR == errno);
+}
+
+static void map_log(const char* path) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (-1 == fd || -1 == fstat(fd, &st)) {
+		fprintf(stderr, "Can't open log '%s': %d, %s\n", path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (st.st_size < sizeof(struct tslog_header)) {
+		fprintf(stderr, "%s is no autolight log\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (MAP_FAILED == header) {
+		fprintf(stderr, "Can't map log '%s': %d, %s\n", path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (memcmp(header->magic, TSLOG_MAGIC, TSLOG_MAGIC_LEN) != 0 || header->record_size != sizeof(struct tslog_record) ||
+		st.st_size != sizeof(struct tslog_header) + (size_t)header->capacity * sizeof(struct tslog_record)) {
+		fprintf(stderr, "%s is no autolight log or has another version\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	records = (const struct tslog_record*)(header + 1);
+}
+
+/**
+ * Copies records numbered from first (at least) to the current count into copy, returns the count.
+ * first receives number of the first copied record, older ones are overwritten already.
+ */
+static uint64_t snapshot(uint64_t* first, struct tslog_record* copy) {
+	for (;;) {
+		uint64_t sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+		uint64_t count, start;
+
+		if (sequence & 1) {
+			usleep(RETRY_INTERVAL_US);
+			continue;
+		}
+
+		count = header->count;
+		start = count > header->capacity && count - header->capacity > *first ? count - header->capacity : *first;
+		if (start > count) {
+			start = count;
+		}
+
+		for (uint64_t n = start; n < count; n++) {
+			copy[n - start] = records[n % header->capacity];
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&header->sequence, __ATOMIC_RELAXED) == sequence) {
+			*first = start;
+			return count;
+		}
+	}
+}
+
+static void dump(const struct tslog_record* record) {
+	printf("{\"time\":%llu.%09llu,\"brightness\":%.4f,\"backlight\":%d,\"frame_us\":%u,\"backlight_us\":%u,"
+		"\"sample_us\":%u,\"point\":%u,\"reused\":%d}\n",
+		(unsigned long long)(record->timestamp_ns / 1000000000), (unsigned long long)(record->timestamp_ns % 1000000000),
+		(double)record->brightness / TSLOG_BRIGHTNESS_SCALE, record->backlight, record->frame_us, record->backlight_us,
+		record->sample_us, record->point, !!(record->flags & TSLOG_FLAG_REUSED));
+}
+
+static int compare_u32(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void summarize_stage(const char* name, uint32_t* values, uint64_t count) {
+	double sum = 0;
+
+	qsort(values, count, sizeof(*values), compare_u32);
+	for (uint64_t i = 0; i < count; i++) {
+		sum += values[i];
+	}
+
+	printf(",\"%s\":{\"mean\":%.1f,\"p50\":%u,\"p95\":%u,\"max\":%u}",
+		name, sum / count, values[count / 2], values[count * 95 / 100], values[count - 1]);
+}
+
+static void summarize(const struct tslog_record* copy, uint64_t count) {
+	uint32_t* values = malloc(count * sizeof(uint32_t));
+	double sum = 0, min = 1, max = 0;
+	unsigned long reused = 0, changes = 0;
+
+	if (NULL == values) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint64_t i = 0; i < count; i++) {
+		double brightness = (double)copy[i].brightness / TSLOG_BRIGHTNESS_SCALE;
+
+		sum += brightness;
+		min = brightness < min ? brightness : min;
+		max = brightness > max ? brightness : max;
+		reused += !!(copy[i].flags & TSLOG_FLAG_REUSED);
+		changes += i > 0 && copy[i].backlight != copy[i - 1].backlight;
+	}
+
+	printf("{\"records\":%llu,\"seconds\":%.1f,\"brightness\":{\"mean\":%.4f,\"min\":%.4f,\"max\":%.4f},"
+		"\"backlight_changes\":%lu,\"reused\":%.3f",
+		(unsigned long long)count, (copy[count - 1].timestamp_ns - copy[0].timestamp_ns) / 1e9,
+		sum / count, min, max, changes, (double)reused / count);
+
+	for (uint64_t i = 0; i < count; i++) values[i] = copy[i].frame_us;
+	summarize_stage("frame_us", values, count);
+	for (uint64_t i = 0; i < count; i++) values[i] = copy[i].backlight_us;
+	summarize_stage("backlight_us", values, count);
+	for (uint64_t i = 0; i < count; i++) values[i] = copy[i].sample_us;
+	summarize_stage("sample_us", values, count);
+
+	printf("}\n");
+	free(values);
+}
+
+int main(int argc, char* argv[]) {
+	struct tslog_record* copy;
+	uint64_t first = 0, count;
+	long last = 0;
+	int summary = 0, follow = 0;
+	int option;
+
+	while ((option = getopt(argc, argv, "sfn:")) != -1) {
+		switch (option) {
+			case 's': {
+				summary = 1;
+				break;
+			}
+			case 'f': {
+				follow = 1;
+				break;
+			}
+			case 'n': {
+				last = atol(optarg);
+				break;
+			}
+			default: {
+				optind = argc;
+				break;
+			}
+		}
+	}
+
+	if (optind != argc - 1 || (summary && follow)) {
+		fprintf(stderr, "Usage: %s [-s | -f] [-n last_records] log_file\n"
+			"\t-s summary, -f print records as they are written\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	map_log(argv[optind]);
+
+	copy = malloc((size_t)header->capacity * sizeof(struct tslog_record));
+	if (NULL == copy) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (last > 0) {
+		count = __atomic_load_n(&header->count, __ATOMIC_RELAXED);
+		first = count > last ? count - last : 0;
+	}
+
+	do {
+		count = snapshot(&first, copy);
+
+		if (summary) {
+			if (count > first) {
+				summarize(copy, count - first);
+			}
+		} else {
+			for (uint64_t n = first; n < count; n++) {
+				dump(&copy[n - first]);
+			}
+			fflush(stdout);
+		}
+
+		first = count;
+		if (follow) {
+			sleep_ms(FOLLOW_INTERVAL_MS);
+		}
+	} while (follow);
+
+	free(copy);
+
+	return EXIT_SUCCESS;
+}